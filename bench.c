@@ -0,0 +1,353 @@
+/*
+ * Benchmark driver for vee-eye
+ *
+ * The editor is compiled in as the library (VEE_LIB) so the buffer code
+ * can be timed directly, without a terminal. A deterministic corpus is
+ * generated on first use (the same bytes on every machine), then each
+ * file is loaded, saved, searched, edited and redrawn. Results go to
+ * stdout as JSON so that runs from different builds can be compared.
+ *
+ * Usage: vi_bench [corpus_dir]
+ * VI_WORKERS sets the thread pool size as it does for the editor.
+ */
+
+#define VEE_LIB
+#include "vi.c"
+
+#ifndef BENCH_CFLAGS
+ #define BENCH_CFLAGS ""
+#endif
+
+#define BENCH_DIR "bench_corpus"
+
+/* Operation counts for the per-operation benchmarks */
+#define BENCH_LOOKUPS 2000
+#define BENCH_EDITS 20000
+#define BENCH_REDRAWS 200
+#define BENCH_ROWS 24
+#define BENCH_COLS 80
+
+/* The corpus: name, generator and target size */
+struct corpus {
+	const char *name;
+	void (*make)(FILE *fp, long size);
+	long size;
+	int edits;		/* edits to time (a long line moves a lot) */
+};
+
+static unsigned long bench_seed;
+
+/* xorshift; the corpus must not depend on the C library's rand() */
+static unsigned long bench_rand(void)
+{
+	bench_seed ^= bench_seed << 13;
+	bench_seed ^= bench_seed >> 7;
+	bench_seed ^= bench_seed << 17;
+	return bench_seed & 0xffffffffUL;
+}
+
+static unsigned long long bench_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* Short lines of C-like code with nesting and blank lines */
+static void make_code(FILE *fp, long size)
+{
+	static const char * const words[] = {
+		"int", "char", "return", "if", "while", "struct", "line",
+		"len", "count", "text", "next", "prev", "i", "j", "NULL"
+	};
+	long done = 0;
+	int depth = 0, n, i;
+
+	while (done < size) {
+		n = bench_rand() % 8;
+		if (n == 0) {
+			fputc('\n', fp);
+			done++;
+			continue;
+		}
+		for (i = 0; i < depth; i++) fputc('\t', fp);
+		done += depth;
+		for (i = 0; i < n; i++) done += fprintf(fp, "%s%s", i ? " " : "",
+				words[bench_rand() % (sizeof(words) / sizeof(words[0]))]);
+		if (depth < 4 && (bench_rand() & 7) == 0) {
+			done += fprintf(fp, " {\n");
+			depth++;
+		} else if (depth > 0 && (bench_rand() & 7) == 0) {
+			done += fprintf(fp, ";\n}\n");
+			depth--;
+		} else done += fprintf(fp, ";\n");
+	}
+	return;
+}
+
+
+/* Syslog-style lines of about 80 bytes */
+static void make_log(FILE *fp, long size)
+{
+	static const char * const level[] = { "INFO", "WARN", "DEBUG", "ERROR" };
+	long done = 0, n = 0;
+
+	while (done < size) {
+		done += fprintf(fp, "2024-01-%02ld %02ld:%02ld:%02ld host%lu %s request %lu took %lums status %lu\n",
+				(n / 86400) % 28 + 1, (n / 3600) % 24, (n / 60) % 60, n % 60,
+				bench_rand() % 16, level[bench_rand() & 3],
+				bench_rand(), bench_rand() % 5000,
+				200 + (bench_rand() % 4) * 100);
+		n++;
+	}
+	return;
+}
+
+
+/* One line with no newline at all */
+static void make_single(FILE *fp, long size)
+{
+	long i;
+
+	for (i = 0; i < size; i++) fputc('a' + (bench_rand() % 26), fp);
+	return;
+}
+
+
+/* Random bytes, NULs and newlines included */
+static void make_binary(FILE *fp, long size)
+{
+	long i;
+
+	for (i = 0; i < size; i++) fputc(bench_rand() & 0xff, fp);
+	return;
+}
+
+
+/* Prose with DOS line endings */
+static void make_crlf(FILE *fp, long size)
+{
+	long done = 0;
+	int n, i;
+
+	while (done < size) {
+		n = 1 + bench_rand() % 12;
+		for (i = 0; i < n; i++) {
+			fputs(i ? " lorem" : "Lorem", fp);
+			done += 6;
+		}
+		fputs(".\r\n", fp);
+		done += 3;
+	}
+	return;
+}
+
+static const struct corpus corpus_list[] = {
+	{ "code", make_code, 8L << 20, BENCH_EDITS },
+	{ "log", make_log, 80L << 20, BENCH_EDITS },
+	{ "single", make_single, 100L << 20, 20 },
+	{ "binary", make_binary, 4L << 20, BENCH_EDITS },
+	{ "crlf", make_crlf, 8L << 20, BENCH_EDITS },
+};
+#define CORPUS_COUNT (int)(sizeof(corpus_list) / sizeof(corpus_list[0]))
+
+
+/* Write a corpus file unless it is already there */
+static int corpus_make(const struct corpus *c, const char *path)
+{
+	struct stat st;
+	FILE *fp;
+
+	if (stat(path, &st) == 0) return 0;
+	fp = fopen(path, "wb");
+	if (!fp) return -1;
+	bench_seed = 2463534242UL;
+	c->make(fp, c->size);
+	if (fclose(fp) != 0) return -1;
+	return 0;
+}
+
+
+/* Drop the whole buffer, its undo history and its folds */
+static void bench_reset(void)
+{
+	undo_free_list(&undo_list);
+	undo_free_list(&redo_list);
+	destroy_buffer(&line_head);
+	line_count = 0;
+	cur_line_s = NULL;
+	cur_line = 1;
+	fold_count = 0;
+	folds_closed = 0;
+	snap_reclaim();
+	return;
+}
+
+
+/* Put the cursor on line 'num' without drawing anything */
+static void bench_goto(int num, int col)
+{
+	cur_line_s = find_line(num);
+	cur_line = num;
+	crsr_y = 1;
+	line_shift = 0;
+	crsr_x = col < cur_line_s->len ? col + 1 : 1;
+	return;
+}
+
+
+/* Load, time and report one corpus file */
+static int bench_file(FILE *out, const struct corpus *c, const char *path, const char *tmp)
+{
+	struct stat st;
+	unsigned long long t, t_load, t_save, t_lookup, t_insert, t_delete, t_search, t_redraw;
+	unsigned long steps, bytes, redraw_bytes;
+	long text_bytes;
+	struct line *line;
+	int lines, num, i;
+
+	if (stat(path, &st) != 0) return -1;
+	bench_reset();
+
+	t = bench_nsec();
+	lines = load_file(path, 0);
+	t_load = bench_nsec() - t;
+	if (lines < 0) return -1;
+	if (line_head == NULL) alloc_new_line(0, NULL, &line_count, &line_head);
+	text_bytes = 0;
+	for (line = line_head; line != NULL; line = line->next) text_bytes += line->len + 1;
+
+	t = bench_nsec();
+	if (save_file(tmp) != 0) return -1;
+	t_save = bench_nsec() - t;
+	unlink(tmp);
+
+	/* Random line lookups, each walking from the last one */
+	bench_seed = 88172645UL;
+	bench_goto(1, 0);
+	steps = stats.walk_steps;
+	t = bench_nsec();
+	for (i = 0; i < BENCH_LOOKUPS; i++) {
+		num = 1 + bench_rand() % line_count;
+		cur_line_s = find_line(num);
+		cur_line = num;
+	}
+	t_lookup = bench_nsec() - t;
+	steps = stats.walk_steps - steps;
+
+	/* Edits at random spots in the first screenful; the undo record is
+	 * made and dropped each time so a long line's copies don't pile up */
+	render_suppressed = 1;
+	t = bench_nsec();
+	for (i = 0; i < c->edits; i++) {
+		bench_goto(1 + bench_rand() % (line_count < BENCH_ROWS ? line_count : BENCH_ROWS),
+				bench_rand() % 64);
+		undo_begin(cur_line, 1);
+		insert_text("bench ", 6, 1, crsr_x - 1);
+		undo_end();
+		undo_free_list(&undo_list);
+	}
+	t_insert = bench_nsec() - t;
+	t = bench_nsec();
+	for (i = 0; i < c->edits; i++) {
+		bench_goto(1 + bench_rand() % (line_count < BENCH_ROWS ? line_count : BENCH_ROWS),
+				bench_rand() % 64);
+		delete_chars(6, 0);
+		undo_free_list(&undo_list);
+	}
+	t_delete = bench_nsec() - t;
+	render_suppressed = 0;
+
+	/* A pattern that is nowhere, so every line is searched */
+	bench_goto(1, 0);
+	t = bench_nsec();
+	do_search("\001no such text\001");
+	t_search = bench_nsec() - t;
+
+	/* Full redraws at random places; output goes to /dev/null */
+	term_flush();
+	bytes = stats.write_bytes;
+	t = bench_nsec();
+	for (i = 0; i < BENCH_REDRAWS; i++) {
+		bench_goto(1 + bench_rand() % line_count, 0);
+		redraw_screen(0, 0);
+		term_flush();
+	}
+	t_redraw = bench_nsec() - t;
+	redraw_bytes = stats.write_bytes - bytes;
+
+	fprintf(out, "    {\"corpus\": \"%s\", \"file_bytes\": %lld, \"lines\": %d, \"text_bytes\": %ld,\n",
+			c->name, (long long)st.st_size, lines, text_bytes);
+	fprintf(out, "     \"load_ms\": %.3f, \"load_mb_s\": %.1f, \"save_ms\": %.3f, \"save_mb_s\": %.1f,\n",
+			t_load / 1e6, st.st_size / 1.048576 / (t_load / 1e3 + 1),
+			t_save / 1e6, st.st_size / 1.048576 / (t_save / 1e3 + 1));
+	fprintf(out, "     \"lookup_ns\": %.0f, \"lookup_steps\": %.0f,\n",
+			(double)t_lookup / BENCH_LOOKUPS, (double)steps / BENCH_LOOKUPS);
+	fprintf(out, "     \"insert_ns\": %.0f, \"delete_ns\": %.0f,\n",
+			(double)t_insert / c->edits, (double)t_delete / c->edits);
+	fprintf(out, "     \"search_ms\": %.3f, \"search_mb_s\": %.1f,\n",
+			t_search / 1e6, st.st_size / 1.048576 / (t_search / 1e3 + 1));
+	fprintf(out, "     \"redraw_us\": %.1f, \"redraw_bytes\": %.0f}",
+			(double)t_redraw / 1e3 / BENCH_REDRAWS, (double)redraw_bytes / BENCH_REDRAWS);
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	const char *dir = (argc > 1) ? argv[1] : BENCH_DIR;
+	FILE *out;
+	int i, fd;
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) goto error_dir;
+	snprintf(tmp, PATH_MAX, "%s/save.tmp", dir);
+	for (i = 0; i < CORPUS_COUNT; i++) {
+		snprintf(path, PATH_MAX, "%s/%s", dir, corpus_list[i].name);
+		if (corpus_make(&corpus_list[i], path) != 0) goto error_corpus;
+	}
+
+	/* The results keep the real stdout; the terminal output and any
+	 * poll for keys get /dev/null */
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	fd = open("/dev/null", O_RDWR);
+	if (!out || fd < 0) goto error_null;
+	dup2(fd, STDIN_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+
+	if (getenv("VI_WORKERS") != NULL) pool_workers = atoi(getenv("VI_WORKERS"));
+	term_rows = BENCH_ROWS - 1;
+	term_real_rows = BENCH_ROWS;
+	term_cols = BENCH_COLS;
+
+	fprintf(out, "{\n  \"version\": 1,\n  \"compiler\": \"%s\",\n  \"cflags\": \"%s\",\n",
+			__VERSION__, BENCH_CFLAGS);
+	fprintf(out, "  \"workers\": %d,\n  \"screen\": [%d, %d],\n  \"results\": [\n",
+			pool_thread_count(), BENCH_COLS, BENCH_ROWS);
+	for (i = 0; i < CORPUS_COUNT; i++) {
+		snprintf(path, PATH_MAX, "%s/%s", dir, corpus_list[i].name);
+		if (bench_file(out, &corpus_list[i], path, tmp) != 0) goto error_bench;
+		fprintf(out, i + 1 < CORPUS_COUNT ? ",\n" : "\n");
+	}
+	fprintf(out, "  ]\n}\n");
+	fclose(out);
+	bench_reset();
+	pool_shutdown();
+	return EXIT_SUCCESS;
+
+error_dir:
+	fprintf(stderr, "cannot create %s: %s\n", dir, strerror(errno));
+	return EXIT_FAILURE;
+error_corpus:
+	fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+	return EXIT_FAILURE;
+error_null:
+	fprintf(stderr, "cannot open /dev/null\n");
+	return EXIT_FAILURE;
+error_bench:
+	fprintf(stderr, "benchmark failed on %s\n", path);
+	return EXIT_FAILURE;
+}
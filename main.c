@@ -0,0 +1,14 @@
+/*
+ * vee-eye: Jody Bruchon's clone of 'vi'
+ * Copyright (C) 2015-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * Distributed under the MIT License (see LICENSE for details)
+ *
+ * The vi binary: the interactive editor in libvee, run as a program.
+ */
+
+#include "vee.h"
+
+int main(int argc, char **argv)
+{
+	return vee_main(argc, argv);
+}
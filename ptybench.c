@@ -0,0 +1,522 @@
+/*
+ * End-to-end keystroke benchmark for vee-eye
+ *
+ * Runs the real editor on a pseudo-terminal with a fixed window size
+ * and feeds it scripted key streams: typing, holding j, counted
+ * deletes, a paste and repeated writes. Each scenario starts from a
+ * fresh copy of the same file; the wall time runs from the first key
+ * to the last byte of output it caused. The output goes through the
+ * screen model in vt.c, which counts the bytes and operations sent
+ * and lets the final screen be checked against the file. read() and
+ * write() calls and keystroke latency come from the editor's own
+ * VI_STATS and VI_LATENCY reports; the keys, reads and writes of a
+ * run with no keys, which only starts up and quits, are taken off so
+ * the per-key figures are the scenario's alone. Results go to stdout
+ * as JSON.
+ *
+ * Usage: vi_ptybench [-r rows] [-c cols] [-d usec] [vi_path [file]]
+ * -d waits between writes to the pty (default: as fast as it accepts).
+ * Without a file, a 200000-line text file is generated.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "vt.h"
+
+#define PTY_LINES 200000
+#define PTY_IDLE_MSEC 300	/* quiet time that means drawing is done */
+#define PTY_EXIT_MSEC 60000	/* give up on a scenario after this long */
+
+/* A growable key stream */
+struct keys {
+	char *data;
+	int len;
+	int alloc;
+};
+
+struct scenario {
+	const char *name;
+	void (*make)(struct keys *k);
+	int chunk;		/* bytes per write to the pty */
+};
+
+/* What one run of the editor measured */
+struct result {
+	unsigned long long wall_ns;
+	unsigned long pty_bytes;
+	unsigned long keys, reads, writes;
+	unsigned long p50, p99, max;
+	struct vt_counts ops;	/* what the keys made the terminal do */
+	int mismatches;		/* screen rows that don't show the file */
+};
+
+static int pty_rows = 24;
+static int pty_cols = 80;
+static long pty_delay = 0;
+static char tmp_dir[] = "/tmp/vi_ptybench.XXXXXX";
+
+
+static unsigned long long pty_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void keys_add(struct keys *k, const char *s, int len)
+{
+	if (k->len + len > k->alloc) {
+		while (k->len + len > k->alloc) k->alloc = k->alloc ? k->alloc << 1 : 4096;
+		k->data = (char *)realloc(k->data, k->alloc);
+		if (!k->data) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memcpy(k->data + k->len, s, len);
+	k->len += len;
+	return;
+}
+
+static void keys_repeat(struct keys *k, const char *s, int count)
+{
+	while (count-- > 0) keys_add(k, s, strlen(s));
+	return;
+}
+
+
+/* A burst of typing into a new line, one key per write */
+static void make_typing(struct keys *k)
+{
+	keys_add(k, "o", 1);
+	keys_repeat(k, "the quick brown fox jumps over the lazy dog 0123456789\r", 40);
+	keys_add(k, "\033", 1);
+	return;
+}
+
+/* Holding j down a few screens, then k back up */
+static void make_hold_j(struct keys *k)
+{
+	keys_repeat(k, "j", 2000);
+	keys_repeat(k, "k", 2000);
+	return;
+}
+
+/* 5dd over and over, then undo all of it */
+static void make_delete(struct keys *k)
+{
+	keys_repeat(k, "5dd", 200);
+	keys_repeat(k, "u", 200);
+	return;
+}
+
+/* A terminal paste: lines of text arriving in big writes */
+static void make_paste(struct keys *k)
+{
+	keys_add(k, "o", 1);
+	keys_repeat(k, "\tpasted_line(with, some, arguments); /* and a comment */\r", 2000);
+	keys_add(k, "\033", 1);
+	return;
+}
+
+/* Saving the whole file a few times */
+static void make_write(struct keys *k)
+{
+	keys_repeat(k, ":w\r", 10);
+	return;
+}
+
+static const struct scenario scenarios[] = {
+	{ "typing", make_typing, 1 },
+	{ "hold_j", make_hold_j, 1 },
+	{ "counted_delete", make_delete, 1 },
+	{ "paste", make_paste, 4096 },
+	{ "write", make_write, 1 },
+};
+#define SCENARIO_COUNT (int)(sizeof(scenarios) / sizeof(scenarios[0]))
+
+
+/* Copy the starting file so every scenario edits the same text */
+static int copy_file(const char *from, const char *to)
+{
+	char buf[65536];
+	ssize_t got;
+	int in, out;
+
+	in = open(from, O_RDONLY);
+	if (in < 0) return -1;
+	out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		close(in);
+		return -1;
+	}
+	while ((got = read(in, buf, sizeof(buf))) > 0)
+		if (write(out, buf, got) != got) break;
+	close(in);
+	if (close(out) != 0 || got != 0) return -1;
+	return 0;
+}
+
+
+/* Generate the default starting file
+ * The tab on every line keeps the screen check honest about redraws
+ * that erase from a byte offset instead of the cursor column. */
+static int make_text(const char *path)
+{
+	FILE *fp;
+	int i;
+
+	fp = fopen(path, "w");
+	if (!fp) return -1;
+	for (i = 1; i <= PTY_LINES; i++)
+		fprintf(fp, "%06d\tint count = line->len + %d; /* %s */\n",
+				i, i % 97, (i & 1) ? "odd" : "even");
+	return fclose(fp);
+}
+
+
+/* Pull a number from a "name   value" line of a report file */
+static unsigned long report_value(const char *text, const char *name)
+{
+	const char *p = strstr(text, name);
+
+	if (p == NULL) return 0;
+	return strtoul(p + strlen(name), NULL, 10);
+}
+
+static int report_read(const char *path, char *buf, int size)
+{
+	int fd, len;
+
+	buf[0] = '\0';
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0) return -1;
+	buf[len] = '\0';
+	unlink(path);
+	return 0;
+}
+
+
+/* Read output until the pty has been quiet for 'msec', feeding it to
+ * the screen model if there is one; returns the bytes read or -1 once
+ * the editor has gone away */
+static long pty_drain(int fd, struct vt *vt, int msec)
+{
+	struct pollfd pfd;
+	char buf[65536];
+	ssize_t got;
+	long total = 0;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, msec) > 0) {
+		got = read(fd, buf, sizeof(buf));
+		if (got <= 0) return (total > 0) ? total : -1;
+		if (vt != NULL) vt_feed(vt, buf, got);
+		total += got;
+	}
+	return total;
+}
+
+
+/* Check the screen at rest against the saved file: the text rows must
+ * show the file's lines from the one that the status line and cursor
+ * row put at the top, with tildes past the end. Tabs are expanded the
+ * way the terminal moves over them. Returns the number of wrong rows. */
+static int screen_check(const struct vt *vt, const char *file)
+{
+	char row[1024], want[1024];
+	char *data, *p, *end, *nl;
+	struct stat st;
+	int fd, cur, col, top, i, n, bad = 0;
+
+	if (vt_row_text(vt, vt->rows, row, sizeof(row)) < vt->cols - 16
+			|| sscanf(row + vt->cols - 17, "%d,%d", &cur, &col) != 2)
+		return vt->rows;
+	top = cur - vt->row;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) return vt->rows;
+	data = (char *)malloc(st.st_size + 1);
+	if (data == NULL || read(fd, data, st.st_size) != st.st_size) {
+		close(fd);
+		free(data);
+		return vt->rows;
+	}
+	close(fd);
+	p = data;
+	end = data + st.st_size;
+	for (n = 1; n < top && p < end; n++) {
+		nl = (char *)memchr(p, '\n', end - p);
+		p = (nl != NULL) ? nl + 1 : end;
+	}
+
+	for (i = 1; i < vt->rows; i++) {
+		vt_row_text(vt, i, row, sizeof(row));
+		if (p < end) {
+			nl = (char *)memchr(p, '\n', end - p);
+			if (nl == NULL) nl = end;
+			for (col = 0; p < nl && col < vt->cols; p++) {
+				if (*p == '\t') {
+					do want[col++] = ' ';
+					while ((col & 7) && col < vt->cols);
+				} else want[col++] = *p;
+			}
+			while (col > 0 && want[col - 1] == ' ') col--;
+			want[col] = '\0';
+			p = nl + 1;
+		} else strcpy(want, "~");
+		if (strcmp(row, want) == 0) continue;
+		if (bad++ < 3) fprintf(stderr, "row %d: got '%s'\n       want '%s'\n", i, row, want);
+	}
+	free(data);
+	return bad;
+}
+
+
+/* Start the editor on a new pty; returns the master side */
+static int pty_spawn(const char *vi, const char *file, pid_t *pid)
+{
+	struct winsize ws;
+	char path[256];
+	int master, slave;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) return -1;
+	memset(&ws, 0, sizeof(ws));
+	ws.ws_row = pty_rows;
+	ws.ws_col = pty_cols;
+	if (ioctl(master, TIOCSWINSZ, &ws) != 0) return -1;
+
+	*pid = fork();
+	if (*pid < 0) return -1;
+	if (*pid == 0) {
+		setsid();
+		slave = open(ptsname(master), O_RDWR);
+		if (slave < 0) _exit(127);
+		close(master);
+		dup2(slave, STDIN_FILENO);
+		dup2(slave, STDOUT_FILENO);
+		dup2(slave, STDERR_FILENO);
+		if (slave > STDERR_FILENO) close(slave);
+		/* No startup script; the reports go to the scratch directory */
+		unsetenv("EXINIT");
+		unsetenv("HOME");
+		snprintf(path, sizeof(path), "%s/stats", tmp_dir);
+		setenv("VI_STATS", path, 1);
+		snprintf(path, sizeof(path), "%s/latency", tmp_dir);
+		setenv("VI_LATENCY", path, 1);
+		setenv("TERM", "vt100", 1);
+		execl(vi, vi, file, (char *)NULL);
+		_exit(127);
+	}
+	return master;
+}
+
+
+/* Play one scenario's keys into a fresh editor
+ * The keys are timed up to the last output they cause. The screen
+ * is then left to settle and checked against the file, which :wq
+ * writes out on the way out. */
+static int run_scenario(const char *vi, const char *file, const struct keys *k,
+		int chunk, struct result *r)
+{
+	struct pollfd pfd;
+	struct vt vt;
+	struct vt_counts before;
+	unsigned long *ops, *prev;
+	char buf[65536], path[256];
+	unsigned long long start, last;
+	ssize_t got;
+	pid_t pid;
+	int master, status, sent = 0, len, ready;
+	unsigned int i;
+
+	memset(r, 0, sizeof(*r));
+	if (vt_init(&vt, pty_rows, pty_cols) != 0) return -1;
+	master = pty_spawn(vi, file, &pid);
+	if (master < 0) goto error_vt;
+	if (pty_drain(master, &vt, PTY_IDLE_MSEC) <= 0) goto error_child;
+
+	fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+	before = vt.count;
+	start = last = pty_nsec();
+	pfd.fd = master;
+	while (1) {
+		pfd.events = POLLIN | ((sent < k->len) ? POLLOUT : 0);
+		ready = poll(&pfd, 1, (sent < k->len) ? PTY_EXIT_MSEC : PTY_IDLE_MSEC);
+		if (ready < 0 || (ready == 0 && sent < k->len)) goto error_child;
+		/* Quiet after the last key: everything has been drawn */
+		if (ready == 0) break;
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			got = read(master, buf, sizeof(buf));
+			if (got == 0 || (got < 0 && errno != EAGAIN)) goto error_child;
+			if (got > 0) {
+				vt_feed(&vt, buf, got);
+				last = pty_nsec();
+			}
+		}
+		if (sent < k->len && (pfd.revents & POLLOUT)) {
+			len = (k->len - sent < chunk) ? k->len - sent : chunk;
+			got = write(master, k->data + sent, len);
+			if (got > 0) sent += got;
+			if (pty_delay > 0) usleep(pty_delay);
+		}
+	}
+	r->wall_ns = last - start;
+	r->ops = vt.count;
+	ops = (unsigned long *)&r->ops;
+	prev = (unsigned long *)&before;
+	for (i = 0; i < sizeof(struct vt_counts) / sizeof(unsigned long); i++) ops[i] -= prev[i];
+	r->pty_bytes = r->ops.bytes;
+
+	/* Save and quit; the rest of the output is not scored */
+	if (write(master, "\033:wq\r", 5) != 5) goto error_child;
+	while (poll(&pfd, 1, PTY_EXIT_MSEC) > 0 && read(master, buf, sizeof(buf)) > 0);
+	if (waitpid(pid, &status, 0) != pid) goto error_child;
+	close(master);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) goto error_vt;
+	r->mismatches = screen_check(&vt, file);
+	vt_free(&vt);
+
+	snprintf(path, sizeof(path), "%s/stats", tmp_dir);
+	if (report_read(path, buf, sizeof(buf)) != 0) return -1;
+	r->keys = report_value(buf, "keys read");
+	r->reads = report_value(buf, "read() calls");
+	r->writes = report_value(buf, "write() calls");
+	snprintf(path, sizeof(path), "%s/latency", tmp_dir);
+	if (report_read(path, buf, sizeof(buf)) != 0) return -1;
+	r->p50 = report_value(buf, "p50");
+	r->p99 = report_value(buf, "p99 ");
+	r->max = report_value(buf, "max");
+	return 0;
+
+error_child:
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+	close(master);
+error_vt:
+	vt_free(&vt);
+	return -1;
+}
+
+
+/* Take what starting up and quitting cost (a run with no keys) out of
+ * a scenario's counts */
+static void result_subtract(struct result *r, const struct result *base)
+{
+	r->keys = (r->keys > base->keys) ? r->keys - base->keys : 0;
+	r->reads = (r->reads > base->reads) ? r->reads - base->reads : 0;
+	r->writes = (r->writes > base->writes) ? r->writes - base->writes : 0;
+	return;
+}
+
+
+int main(int argc, char **argv)
+{
+	char text[256], file[256];
+	const char *vi = "./vi";
+	const char *source = NULL;
+	struct keys k;
+	struct result r, base;
+	unsigned long frames;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "r:c:d:")) != -1) {
+		switch (opt) {
+		case 'r': pty_rows = atoi(optarg); break;
+		case 'c': pty_cols = atoi(optarg); break;
+		case 'd': pty_delay = atol(optarg); break;
+		default: goto error_usage;
+		}
+	}
+	if (pty_rows < 2 || pty_cols < 2) goto error_usage;
+	if (optind < argc) vi = argv[optind++];
+	if (optind < argc) source = argv[optind++];
+
+	if (mkdtemp(tmp_dir) == NULL) goto error_tmp;
+	snprintf(file, sizeof(file), "%s/edit.txt", tmp_dir);
+	if (source == NULL) {
+		snprintf(text, sizeof(text), "%s/start.txt", tmp_dir);
+		if (make_text(text) != 0) goto error_tmp;
+		source = text;
+	}
+
+	memset(&k, 0, sizeof(k));
+	if (copy_file(source, file) != 0) goto error_tmp;
+	if (run_scenario(vi, file, &k, 1, &base) != 0) goto error_base;
+
+	printf("{\n  \"version\": 1,\n  \"vi\": \"%s\",\n  \"screen\": [%d, %d],\n"
+			"  \"delay_us\": %ld,\n",
+			vi, pty_cols, pty_rows, pty_delay);
+	printf("  \"baseline\": {\"keys\": %lu, \"reads\": %lu, \"writes\": %lu},\n"
+			"  \"scenarios\": [\n", base.keys, base.reads, base.writes);
+	for (i = 0; i < SCENARIO_COUNT; i++) {
+		k.len = 0;
+		scenarios[i].make(&k);
+		if (copy_file(source, file) != 0) goto error_tmp;
+		if (run_scenario(vi, file, &k, scenarios[i].chunk, &r) != 0) goto error_run;
+		result_subtract(&r, &base);
+		if (r.keys == 0) r.keys = 1;
+		printf("    {\"name\": \"%s\", \"keys\": %lu, \"wall_ms\": %.3f, \"us_per_key\": %.2f,\n",
+				scenarios[i].name, r.keys, r.wall_ns / 1e6, r.wall_ns / 1e3 / r.keys);
+		printf("     \"pty_bytes\": %lu, \"bytes_per_key\": %.1f, \"reads\": %lu, \"writes\": %lu,"
+				" \"syscalls_per_key\": %.3f,\n",
+				r.pty_bytes, (double)r.pty_bytes / r.keys, r.reads, r.writes,
+				(double)(r.reads + r.writes) / r.keys);
+		printf("     \"p50_us\": %lu, \"p99_us\": %lu, \"max_us\": %lu,\n",
+				r.p50, r.p99, r.max);
+		frames = r.writes ? r.writes : 1;
+		printf("     \"frames\": %lu, \"bytes_per_frame\": %.1f, \"ops_per_frame\": %.1f,\n",
+				r.writes, (double)r.pty_bytes / frames,
+				(double)(r.ops.controls + r.ops.cup + r.ops.moves + r.ops.el + r.ops.ed
+				+ r.ops.scrolls + r.ops.stbm + r.ops.sgr + r.ops.modes) / frames);
+		printf("     \"ops\": {\"text\": %lu, \"controls\": %lu, \"cup\": %lu, \"moves\": %lu,"
+				" \"el\": %lu, \"ed\": %lu, \"scrolls\": %lu, \"stbm\": %lu, \"sgr\": %lu,"
+				" \"modes\": %lu, \"unknown\": %lu},\n",
+				r.ops.text, r.ops.controls, r.ops.cup, r.ops.moves, r.ops.el, r.ops.ed,
+				r.ops.scrolls, r.ops.stbm, r.ops.sgr, r.ops.modes, r.ops.unknown);
+		printf("     \"screen_ok\": %s, \"screen_mismatches\": %d}%s\n",
+				r.mismatches ? "false" : "true", r.mismatches,
+				(i + 1 < SCENARIO_COUNT) ? "," : "");
+		fflush(stdout);
+	}
+	printf("  ]\n}\n");
+	free(k.data);
+	unlink(file);
+	if (source == text) unlink(text);
+	rmdir(tmp_dir);
+	return EXIT_SUCCESS;
+
+error_usage:
+	fprintf(stderr, "usage: %s [-r rows] [-c cols] [-d usec] [vi_path [file]]\n", argv[0]);
+	return EXIT_FAILURE;
+error_tmp:
+	fprintf(stderr, "cannot set up %s: %s\n", tmp_dir, strerror(errno));
+	return EXIT_FAILURE;
+error_base:
+	fprintf(stderr, "baseline run failed\n");
+	return EXIT_FAILURE;
+error_run:
+	fprintf(stderr, "scenario '%s' failed\n", scenarios[i].name);
+	return EXIT_FAILURE;
+}
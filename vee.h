@@ -0,0 +1,52 @@
+/*
+ * libvee: vee-eye's buffer engine as a library
+ *
+ * A buffer holds the lines of one file along with its own undo and
+ * redo history. Lines are numbered from 1 and columns from 0; text
+ * passed in may contain '\n' to split lines. Buffers can be opened
+ * side by side, but the library is not thread-safe: call it from one
+ * thread at a time. Running out of memory exits the process, as the
+ * editor does.
+ *
+ * vee_main() is the whole interactive editor; the vi binary is just
+ * a call to it.
+ */
+
+#ifndef VEE_H
+#define VEE_H
+
+struct vee_buffer;
+
+/* Open 'path' (a missing file gives an empty buffer with that name,
+ * NULL or "" an unnamed one); returns NULL if it can't be read */
+extern struct vee_buffer *vee_open(const char *path);
+extern void vee_close(struct vee_buffer *buf);
+
+/* Write the buffer to 'path', or to its own file if that is NULL;
+ * returns 0 on success */
+extern int vee_save(struct vee_buffer *buf, const char *path);
+
+extern int vee_line_count(struct vee_buffer *buf);
+
+/* A line's text (NUL-terminated) and length, or NULL past the end;
+ * valid until the buffer next changes. Reading lines in order costs
+ * O(1) each. */
+extern const char *vee_line(struct vee_buffer *buf, int num, int *len);
+
+/* Edits; each one is a single undo step. They return 0 on success
+ * and -1 if the position is outside the buffer (a column may be at
+ * most the line's length) or a count is not positive. Deletes stop at
+ * the end of the line or the buffer. */
+extern int vee_insert(struct vee_buffer *buf, int line, int col, const char *text, int len);
+extern int vee_delete(struct vee_buffer *buf, int line, int col, int count);
+extern int vee_delete_lines(struct vee_buffer *buf, int line, int count);
+extern int vee_undo(struct vee_buffer *buf);
+extern int vee_redo(struct vee_buffer *buf);
+
+/* Find plain text after (*line, *col), wrapping around the end as '/'
+ * does; on a match returns 0 and moves *line and *col to it */
+extern int vee_search(struct vee_buffer *buf, const char *pattern, int *line, int *col);
+
+extern int vee_main(int argc, char **argv);
+
+#endif	/* VEE_H */
@@ -19,19 +19,48 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <termios.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 
 #ifndef NO_SIGNALS
  #include <signal.h>
 #endif	/* NO_SIGNALS */
 
+/* Builds without signals (ELKS) have no threads either */
+#if defined(NO_SIGNALS) || defined(__ELKS__)
+ #ifndef NO_THREADS
+  #define NO_THREADS
+ #endif
+#endif
+#ifndef NO_THREADS
+ #include <pthread.h>
+#endif	/* NO_THREADS */
+#ifndef __ELKS__
+ #include <poll.h>
+ #include <sys/mman.h>
+#endif	/* __ELKS__ */
+#ifdef __SSE2__
+ #include <emmintrin.h>
+#endif	/* __SSE2__ */
+#ifdef __GLIBC__
+ #include <malloc.h>
+#endif	/* __GLIBC__ */
+
 /* Dev86 used for ELKS isn't C99 compliant */
+#ifdef VEE_LIB
+ #include "vee.h"
+#endif	/* VEE_LIB */
+
 #ifdef __ELKS__
  #define uintptr_t unsigned short
  #define restrict
@@ -75,6 +104,9 @@ static struct {
 	int start_char;
 	int dest_line;
 	int dest_char;
+	char motion;		/* the motion key and its argument ('fx') */
+	char motion_arg;
+	int count;
 } cur_movement;
 
 /* Text is stored line-by-line. Line lengths are stored with the text data
@@ -88,13 +120,112 @@ struct line {
 	char *text;
 	int len;
 	int alloc_size;
+	unsigned int text_epoch;	/* buf_epoch when text was allocated */
+	unsigned char flags;		/* LINE_MARKED, LINE_FOLD */
 };
+#define LINE_MARKED 0x01		/* a mark may point at this line */
+#define LINE_FOLD 0x02			/* a fold may start or end here */
+#define LINE_ARENA_NODE 0x04		/* the node lives in a line arena */
+#define LINE_ARENA_TEXT 0x08		/* the text lives in a line arena */
 static struct line *line_head = NULL;
 
+/* Marks and the jump list point at line nodes, so edits above them
+ * need no fix-up; a line's number is found when the mark is used.
+ * Freeing a node flagged LINE_MARKED clears whatever points at it. */
+struct mark {
+	struct line *line;	/* NULL if unset or the line was freed */
+	int col;
+};
+#define JUMP_MAX 100
+static struct mark marks[26];
+static struct mark mark_prev;		/* '' and `` */
+static struct mark jump_list[JUMP_MAX];
+static int jump_len = 0;
+static int jump_pos = 0;
+static int marks_used = 0;
+
+/* Folds hide a range of lines behind one screen row; they don't nest.
+ * A fold points at its first and last line nodes (flagged LINE_FOLD),
+ * and its line numbers are moved along as lines come and go, which
+ * costs O(folds) per change. The table is kept in line order, so
+ * converting between screen rows and line numbers is arithmetic over
+ * the folds, and drawing hops over a closed fold through its end
+ * pointer without touching any line inside it. */
+struct fold {
+	struct line *start;
+	struct line *end;
+	int start_num;
+	int end_num;
+	char closed;
+};
+static struct fold *folds = NULL;
+static int fold_count = 0;
+static int fold_alloc = 0;
+static int folds_closed = 0;
+
+/* Buffer snapshots for background readers
+ * A snapshot is a read-only copy of a range of lines (text pointer and
+ * length per line) which other threads can read without any locking.
+ * The copy is kept in chunks of SNAP_CHUNK lines so a big buffer never
+ * needs one huge block; SNAP_LINE() finds a line in it. The text itself
+ * is not copied: every snapshot has an epoch, and a line whose text is
+ * older than the newest live snapshot is copied before it is modified
+ * (line_cow()) or retired instead of freed when the line goes away.
+ * Retired text is freed by snap_reclaim() once no live snapshot is old
+ * enough to see it. Taking, dropping and reclaiming snapshots never
+ * blocks the editor; snap_put() may be called from any thread but
+ * everything else is main thread only. */
+struct snap_line {
+	const char *text;
+	int len;
+};
+#define SNAP_CHUNK 4096
+struct snapshot {
+	struct snapshot *next;
+	int refs;
+	unsigned int epoch;
+	int line_count;
+	struct snap_line **chunks;
+	size_t size;		/* bytes allocated, chunks not counted */
+};
+#define SNAP_LINE(snap, i) (&(snap)->chunks[(i) / SNAP_CHUNK][(i) % SNAP_CHUNK])
+struct snap_retired {
+	struct snap_retired *next;
+	char *text;
+	int size;		/* the text's alloc_size */
+	char in_arena;		/* the text lives in a line arena */
+	unsigned int epoch;	/* newest snapshot that may see text */
+};
+static struct snapshot *snap_list = NULL;
+static struct snap_retired *snap_retired_list = NULL;
+static unsigned int buf_epoch = 1;
+static unsigned int snap_newest_live = 0;
+
 /* Yank buffer */
 static struct line *yank_head = NULL;
 static int yank_line_count = 0;
 
+/* Undo log
+ * Every change is recorded as a range of lines: undo_begin() saves a
+ * copy of the lines a command is about to change and undo_end() notes
+ * how many lines replaced them. Undoing swaps the saved lines back in
+ * and keeps the lines it took out as the redo record, so neither
+ * direction copies any text. Nested begin/end pairs fold into the
+ * outermost one, which must cover every line the inner ones touch. */
+struct undo_rec {
+	struct undo_rec *next;
+	struct line *lines;	/* saved lines (detached list) */
+	int start;		/* first line of the change */
+	int old_count;		/* number of saved lines */
+	int new_count;		/* number of lines that replaced them */
+	int col;		/* cursor column before the change */
+};
+static struct undo_rec *undo_list = NULL;
+static struct undo_rec *redo_list = NULL;
+static struct undo_rec *undo_open = NULL;
+static int undo_depth = 0;
+static int undo_line_count = 0;
+
 /* Terminal configuration data */
 static struct termios term_orig, term_config;
 static int termdesc = -1;
@@ -122,32 +253,257 @@ static struct line *cur_line_s = NULL;
 #define MODE_INSERT 1
 #define MODE_REPLACE 2
 static int vi_mode = 0;
+static int shift_width = 8;	/* columns moved by > and < */
+static int expand_tab = 0;	/* > and < indent with spaces only */
+
+/* Visual mode: 'v', 'V' or Ctrl-V while a selection is active, or 0
+ * The selection runs from the anchor to the cursor; only redraw_line()
+ * looks at it, so highlighting costs nothing beyond the visible rows. */
+static char visual_mode = 0;
+static int visual_line = 0;
+static int visual_col = 0;
+struct region {
+	int l1, c1;		/* first line and column (0-based) */
+	int l2, c2;		/* last line and column, inclusive */
+	char mode;
+};
 static const char * const mode_string[] = {
 	"", "-- INSERT --", "-- REPLACE --"
 };
 #define MAX_STATUS 64
 static char custom_status[MAX_STATUS] = "";
 
+/* Keys read ahead of time (e.g. while polling for cancellation) */
+#define TYPEAHEAD_SIZE 64
+static char typeahead[TYPEAHEAD_SIZE];
+static int typeahead_len = 0;
+
+/* Session recording and replay
+ * VI_RECORD names a file that gets every byte read from the terminal
+ * and every resize, each with the microseconds since the event before.
+ * VI_REPLAY plays such a file back in place of a terminal: no tty is
+ * needed and the screen output just goes to stdout. The recorded gaps
+ * decide whether keys arrived together (ESC sequences, mapping
+ * timeouts) and keys typed during a long operation reach it at its
+ * first poll, so a replay does the same thing however fast it runs.
+ * The file is text:
+ *	vee-eye session 1 <rows> <cols>
+ *	k <usec> <byte>		a key
+ *	p <usec> <byte>		a key read while a long operation polled
+ *	r <usec> <rows> <cols>	the terminal was resized */
+static FILE *session_rec = NULL;
+static FILE *session_play = NULL;
+static unsigned long session_last = 0;	/* when the last event was recorded */
+static int session_rows, session_cols;	/* replayed terminal size */
+static struct {
+	char type;		/* 'k', 'p', 'r' or 0 after the last one */
+	unsigned long usec;
+	int a, b;
+} session_next;
+
+/* Last search pattern */
+static char search_pattern[MAX_CMDSIZE] = "";
+
+/* The last change in compiled form, for the '.' command
+ * op is the command key and motion the key that completed it (e.g.
+ * 'd' for "dd"); text holds whatever was typed in insert mode with
+ * lines separated by '\n'. Repeating a change runs it directly from
+ * this record instead of feeding keys back through do_cmd(). */
+static struct {
+	char op;
+	char motion;
+	char motion_arg;
+	int count;
+	char *text;
+	int text_len;
+	int text_alloc;
+} last_change;
+static int insert_capture = 0;	/* edit_mode() fills last_change.text */
+
+/* Bytes that R typed over, so backspace can put them back */
+static char *replace_save = NULL;
+static int replace_save_alloc = 0;
+static int replace_saved = 0;	/* originals in replace_save */
+static int replace_typed = 0;	/* keys typed on this line since R */
+
+/* c{motion} types over the changed span: the text from the cursor up to
+ * change_gap_end is still to be replaced and ESC removes what is left.
+ * change_gap_end is -1 when no change is in progress. */
+static int change_gap_start = 0;
+static int change_gap_end = -1;
+
 /* Total number of lines allocated */
 static int line_count = 0;
 
-/* File read/write buffer */
+/* File read size */
 #define CHUNK_SIZE 4096
-static char buf[CHUNK_SIZE];
+
+/* Thread pool for heavy operations
+ * Work is handed to pool_run() as a range of items which is cut into
+ * tasks of at most POOL_MAX_GRAIN items. Each thread owns a deque of
+ * tasks; owners pop the newest task and idle threads steal the oldest
+ * task from other deques. The thread that calls pool_run() helps with
+ * the work until it is finished, so the caller never sleeps while there
+ * is work it could do. pool_workers is the number of extra threads; 0
+ * runs every task inline in the calling thread. The default leaves one
+ * CPU free so that parallel work never starves the input/render loop.
+ * Task functions must not touch the screen or custom_status. */
+#define POOL_MAX_WORKERS 16
+#define POOL_MAX_GRAIN 65536
+#define POOL_TASKS_PER_THREAD 8
+#define POOL_DEQUE_SIZE (POOL_TASKS_PER_THREAD * (POOL_MAX_WORKERS + 1))
+typedef void (*pool_fn)(void *arg, long start, long end);
+/* Cancellation token: set cancelled to stop tasks that have not started */
+struct cancel_token {
+	volatile int cancelled;
+};
+static int pool_workers = -1;	/* -1 = pick based on CPU count */
+#ifndef NO_THREADS
+struct pool_task {
+	pool_fn fn;
+	void *arg;
+	long start;
+	long end;
+};
+struct pool_deque {
+	pthread_mutex_t lock;
+	int head;	/* oldest task; thieves take from here */
+	int tail;	/* one past newest task; owner takes from here */
+	struct pool_task tasks[POOL_DEQUE_SIZE];
+};
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;	/* workers wait for a job here */
+	pthread_cond_t done_cond;	/* pool_run() waits for completion */
+	pthread_t threads[POOL_MAX_WORKERS];
+	struct pool_deque deques[POOL_MAX_WORKERS + 1];	/* [0] = caller */
+	struct cancel_token *cancel;
+	int started;		/* number of running worker threads */
+	long pending;		/* tasks not yet finished */
+	int generation;		/* bumped for every job */
+	int shutdown;
+} pool;
+#endif	/* NO_THREADS */
+
+/* Long-running operations
+ * Heavy commands call op_begin(), report progress with op_progress()
+ * every so often and finish with op_end(). Progress shows up in the
+ * status line once an operation has run for a while, and ESC or Ctrl-C
+ * cancels it. Only operations that leave the buffer alone (writing and
+ * searching) check for that; edits always run to the end, so a cancel
+ * never has a half-made change to roll back. Pool tasks add to op_done
+ * with OP_DONE_ADD() and pool_run() polls on their behalf. */
+#define OP_POLL_MSEC 50
+#define OP_SHOW_MSEC 250
+static struct cancel_token op_token;
+static const char *op_name = NULL;
+static long op_done, op_total;
+static unsigned long op_start, op_last_poll;
+#ifdef NO_THREADS
+ #define OP_DONE_ADD(n) (op_done += (n))
+#else
+ #define OP_DONE_ADD(n) __atomic_add_fetch(&op_done, (n), __ATOMIC_RELAXED)
+#endif	/* NO_THREADS */
+
+/* Terminal output is collected here and written out in one go when
+ * the editor is about to wait for input (or the buffer fills up).
+ * While a macro is replayed nothing is drawn at all; the screen is
+ * repainted once the replay is finished. */
+#define OUT_BUF_SIZE 16384
+static char out_buf[OUT_BUF_SIZE];
+static int out_len = 0;
+static int render_suppressed = 0;
+
+/* Macro registers (a-z) for q/@ and the macros being replayed */
+#define MACRO_DEPTH 8
+static char *macro_reg[26];
+static int macro_len[26];
+static int macro_recording = -1;	/* register being recorded or -1 */
+static int macro_last = -1;		/* register for @@ */
+static char *record_buf = NULL;
+static int record_len = 0;
+static int record_alloc = 0;
+static struct {
+	const char *keys;
+	int len;
+	int pos;
+	long count;
+} replay[MACRO_DEPTH];
+static int replay_depth = 0;
+static volatile int key_interrupt = 0;
+
+/* Key mappings (:map, :imap, :noremap, ...)
+ * Each mode has a trie of left-hand sides. The first key of every
+ * mapping is looked up directly in map_root[], so a key that starts no
+ * mapping costs a single array load no matter how many mappings exist;
+ * further keys walk the (small) sibling lists below it. Expanded keys
+ * wait in map_pending along with a flag saying whether they may be
+ * mapped again. */
+#define MAP_NONE -1
+#define MAP_NORMAL 0
+#define MAP_INSERT 1
+#define MAP_MODES 2
+#define MAP_MAX_PENDING 4096
+#define MAP_MAX_EXPAND 1000
+struct map_node {
+	struct map_node *next;		/* sibling with another key */
+	struct map_node *child;		/* continuations of this key */
+	char *rhs;			/* NULL if no mapping ends here */
+	int rhs_len;
+	char key;
+	char noremap;
+};
+static struct map_node *map_root[MAP_MODES][256];
+static int map_count = 0;
+static int map_timeout = 1000;		/* msec to wait for the rest of a mapping */
+static char map_pending[MAP_MAX_PENDING];
+static char map_pending_noremap[MAP_MAX_PENDING];
+static int map_pending_start = MAP_MAX_PENDING;
+
+/* Startup commands come from EXINIT or ~/.exrc. What they do (option
+ * values and mappings) is saved to EXRC_CACHE in the home directory,
+ * tagged with the source's mtime/size/inode or the EXINIT hash, so a
+ * warm start applies the saved result without parsing anything. */
+#define EXRC_CACHE ".vi_exrc.cache"
+#define EXRC_CACHE_VERSION 1
+struct exrc_cache_header {
+	char magic[4];
+	unsigned int version;
+	unsigned int option_count;
+	unsigned int record_count;
+	unsigned long long mtime_sec;
+	unsigned long long mtime_nsec;
+	unsigned long long size;
+	unsigned long long ino;
+	unsigned long long hash;
+};
+/* Record types that follow the header */
+#define EXRC_REC_OPTION 1
+#define EXRC_REC_MAP 2
+struct exrc_cache_rec {
+	unsigned char type;
+	unsigned char mode;	/* EXRC_REC_MAP: map mode */
+	unsigned char noremap;
+	unsigned char index;	/* EXRC_REC_OPTION: index into options[] */
+	unsigned short lhs_len;	/* lhs and rhs bytes follow the record */
+	unsigned short rhs_len;
+	int value;
+};
+static volatile int winch_pending = 0;
 
 /* Escape sequence function definitions */
-#define CLEAR_SCREEN()	write(STDOUT_FILENO, "\033[H\033[J", 6);
-#define ERASE_LINE()	write(STDOUT_FILENO, "\033[2K", 4);
-#define ERASE_TO_EOL()	write(STDOUT_FILENO, "\033[K", 3);
-#define CRSR_HOME()	write(STDOUT_FILENO, "\033[H", 3);
-#define CRSR_UP()	write(STDOUT_FILENO, "\033[1A", 4);
-#define CRSR_DOWN()	write(STDOUT_FILENO, "\033[1B", 4);
-#define CRSR_LEFT()	write(STDOUT_FILENO, "\033[1D", 4);
-#define CRSR_RIGHT()	write(STDOUT_FILENO, "\033[1C", 4);
-#define SCROLL_UP()	crsr_yx(1,1); write(STDOUT_FILENO, "\033M", 2); crsr_restore();
-#define SCROLL_DOWN()	crsr_yx(term_real_rows,1); write(STDOUT_FILENO, "\033D", 2); crsr_restore();
-#define DISABLE_LINE_WRAP()	write(STDOUT_FILENO, "\033[7l", 4);
-#define ENABLE_LINE_WRAP() 	write(STDOUT_FILENO, "\033[7h", 4);
+#define CLEAR_SCREEN()	term_write("\033[H\033[J", 6);
+#define ERASE_LINE()	term_write("\033[2K", 4);
+#define ERASE_TO_EOL()	term_write("\033[K", 3);
+#define CRSR_HOME()	term_write("\033[H", 3);
+#define CRSR_UP()	term_write("\033[1A", 4);
+#define CRSR_DOWN()	term_write("\033[1B", 4);
+#define CRSR_LEFT()	term_write("\033[1D", 4);
+#define CRSR_RIGHT()	term_write("\033[1C", 4);
+#define SCROLL_UP()	crsr_yx(1,1); term_write("\033M", 2); crsr_restore();
+#define SCROLL_DOWN()	crsr_yx(term_real_rows,1); term_write("\033D", 2); crsr_restore();
+#define DISABLE_LINE_WRAP()	term_write("\033[7l", 4);
+#define ENABLE_LINE_WRAP() 	term_write("\033[7h", 4);
 
 
 /* Function prototypes */
@@ -156,6 +512,22 @@ static void clean_abort(void);
 static void update_status(void);
 static void redraw_screen(int row_start, int row_end);
 static void destroy_buffer(struct line **head);
+static int join_lines(int start, int count, int spaces);
+static void marks_move(const struct line *from, struct line *to);
+static void fold_forget(const struct line *line);
+static void fold_lines_added(int after, int count, const struct line *lines);
+static void fold_open_cursor(void);
+static void fold_open_line(int num);
+static struct fold *fold_closed_at(const struct line *line, int at_end);
+static int line_row(int num);
+static int row_line(int row);
+static int read_key(char *c);
+static unsigned long now_usec(void);
+static void session_event(char type, int a, int b);
+static void session_close(void);
+static int word_class(char c, int big);
+static void pool_shutdown(void);
+static void op_poll(void);
 static void do_cursor_up(void);
 static void do_cursor_down(void);
 static void do_cursor_left(void);
@@ -175,47 +547,298 @@ static void oh_dear_god_no(char *string)
 }
 
 
+/* Performance counters: shown by :stats, and written at exit to the
+ * file named by VI_STATS ("-" for stderr) */
+struct vi_stats {
+	unsigned long keys;
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long write_bytes;
+	unsigned long mallocs;
+	unsigned long reallocs;
+	unsigned long frees;
+	unsigned long alloc_bytes;
+	unsigned long walk_steps;
+	unsigned long full_redraws;
+	unsigned long partial_redraws;
+	unsigned long line_paints;
+};
+static struct vi_stats stats;
+
+/* Workers allocate too, so counters are bumped atomically */
+#ifdef NO_THREADS
+ #define STAT_ADD(field, n) (stats.field += (n))
+#else
+ #define STAT_ADD(field, n) __atomic_add_fetch(&stats.field, (n), __ATOMIC_RELAXED)
+#endif	/* NO_THREADS */
+
+
+#ifdef VI_TRACE
+/* Event tracer (build with -DVI_TRACE)
+ * Begin/end events from the main thread go into a ring that keeps the
+ * most recent TRACE_SIZE of them. :trace and clean_abort() write the
+ * ring to debug.log as Chrome trace JSON (chrome://tracing, Perfetto). */
+#define TRACE_SIZE 65536	/* must be a power of two */
+struct trace_event {
+	unsigned long long ns;
+	const char *name;
+	char phase;
+};
+static struct trace_event trace_ring[TRACE_SIZE];
+static unsigned long trace_count = 0;
+ #define TRACE_BEGIN(name) trace_event((name), 'B')
+ #define TRACE_END(name) trace_event((name), 'E')
+
+static void trace_event(const char *name, char phase)
+{
+	struct trace_event *ev = &trace_ring[trace_count++ & (TRACE_SIZE - 1)];
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ev->ns = (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	ev->name = name;
+	ev->phase = phase;
+	return;
+}
+
+
+/* Write the ring out, oldest event first; returns nonzero on failure */
+static int trace_dump(void)
+{
+	struct trace_event *ev;
+	unsigned long i;
+	FILE *fp;
+
+	fp = fopen("debug.log", "w");
+	if (fp == NULL) return 1;
+	fputs("{\"traceEvents\":[\n", fp);
+	i = (trace_count > TRACE_SIZE) ? trace_count - TRACE_SIZE : 0;
+	for (; i < trace_count; i++) {
+		ev = &trace_ring[i & (TRACE_SIZE - 1)];
+		fprintf(fp, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,"
+				"\"pid\":%d,\"tid\":1}%s\n",
+				ev->name, ev->phase, ev->ns / 1000, ev->ns % 1000,
+				(int)getpid(), (i + 1 < trace_count) ? "," : "");
+	}
+	fputs("]}\n", fp);
+	return fclose(fp) != 0;
+}
+#else
+ #define TRACE_BEGIN(name) do {} while (0)
+ #define TRACE_END(name) do {} while (0)
+#endif	/* VI_TRACE */
+
+
+/* Memory accounting
+ * Every allocation is tagged with the subsystem that owns it and the
+ * caller passes the size again when it frees or resizes the block, so
+ * :mem can show live and peak bytes per subsystem without a header on
+ * every block. */
+#define MEM_NODE 0	/* line nodes */
+#define MEM_TEXT 1	/* line text */
+#define MEM_UNDO 2	/* undo records (their lines count as nodes/text) */
+#define MEM_SNAP 3	/* snapshots */
+#define MEM_MACRO 4	/* macro registers and recording */
+#define MEM_MAP 5	/* key mappings */
+#define MEM_EDIT 6	/* dot repeat, replace mode and scratch text */
+#define MEM_FOLD 7	/* fold table */
+#define MEM_LOAD 8	/* file loading */
+#define MEM_ARENA 9	/* compacted lines (nodes and text) */
+#define MEM_MISC 10
+#define MEM_TAGS 11
+static const char * const mem_tag_name[MEM_TAGS] = {
+	"line nodes", "line text", "undo log", "snapshots", "macros",
+	"mappings", "edit buffers", "folds", "file load", "line arenas",
+	"other"
+};
+struct mem_usage {
+	long live;
+	long peak;
+	long blocks;
+};
+static struct mem_usage mem_usage[MEM_TAGS];
+
+#ifdef NO_THREADS
+ #define MEM_ADD(tag, field, n) (mem_usage[tag].field += (n))
+#else
+ #define MEM_ADD(tag, field, n) __atomic_add_fetch(&mem_usage[tag].field, (n), __ATOMIC_RELAXED)
+#endif	/* NO_THREADS */
+
+
+/* Account for 'bytes' more (or fewer) live bytes under 'tag' */
+static void mem_account(int tag, long bytes, long blocks)
+{
+	long live;
+#ifndef NO_THREADS
+	long peak;
+#endif	/* NO_THREADS */
+
+	MEM_ADD(tag, blocks, blocks);
+	live = MEM_ADD(tag, live, bytes);
+#ifdef NO_THREADS
+	if (live > mem_usage[tag].peak) mem_usage[tag].peak = live;
+#else
+	/* Pool workers allocate too, so raise the peak with a CAS */
+	peak = __atomic_load_n(&mem_usage[tag].peak, __ATOMIC_RELAXED);
+	while (live > peak && !__atomic_compare_exchange_n(&mem_usage[tag].peak,
+				&peak, live, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+#endif	/* NO_THREADS */
+	return;
+}
+
+
+/* Tagged, counted wrappers for the C allocator */
+static void *vi_malloc(int tag, size_t size)
+{
+	void *ptr;
+
+	STAT_ADD(mallocs, 1);
+	STAT_ADD(alloc_bytes, size);
+	ptr = malloc(size);
+	if (ptr != NULL) mem_account(tag, (long)size, 1);
+	return ptr;
+}
+
+
+static void *vi_calloc(int tag, size_t count, size_t size)
+{
+	void *ptr;
+
+	STAT_ADD(mallocs, 1);
+	STAT_ADD(alloc_bytes, count * size);
+	ptr = calloc(count, size);
+	if (ptr != NULL) mem_account(tag, (long)(count * size), 1);
+	return ptr;
+}
+
+
+/* 'old_size' is what 'ptr' was allocated with (0 if it is NULL) */
+static void *vi_realloc(int tag, void *ptr, size_t old_size, size_t size)
+{
+	void *new_ptr;
+
+	STAT_ADD(reallocs, 1);
+	STAT_ADD(alloc_bytes, size);
+	new_ptr = realloc(ptr, size);
+	if (new_ptr != NULL) mem_account(tag, (long)size - (long)old_size, ptr == NULL);
+	return new_ptr;
+}
+
+
+static void vi_free(int tag, void *ptr, size_t size)
+{
+	if (ptr == NULL) return;
+	STAT_ADD(frees, 1);
+	mem_account(tag, -(long)size, -1);
+	free(ptr);
+	return;
+}
+
+
+/* Write a block of data to the terminal, retrying partial writes */
+static void write_all(const char *data, int len)
+{
+	ssize_t done;
+
+	while (len > 0) {
+		done = write(STDOUT_FILENO, data, len);
+		STAT_ADD(writes, 1);
+		if (done < 0) {
+			if (errno == EINTR) continue;
+			return;
+		}
+		STAT_ADD(write_bytes, done);
+		data += done;
+		len -= done;
+	}
+	return;
+}
+
+
+/* Write everything collected in out_buf to the terminal */
+static void term_flush(void)
+{
+	if (out_len == 0) return;
+	TRACE_BEGIN("flush");
+	write_all(out_buf, out_len);
+	out_len = 0;
+	TRACE_END("flush");
+	return;
+}
+
+
+/* Queue output for the terminal */
+static void term_write(const char *data, int len)
+{
+	if (render_suppressed) return;
+	if (out_len + len > OUT_BUF_SIZE) {
+		term_flush();
+		if (len > OUT_BUF_SIZE) {
+			write_all(data, len);
+			return;
+		}
+	}
+	memcpy(out_buf + out_len, data, len);
+	out_len += len;
+	return;
+}
+
+
 /* Cursor control functions */
-void crsr_restore(void)
+static void crsr_restore(void)
 {
 	sprintf(crsr_set_string, "\033[%d;%df", crsr_y, crsr_x);
-	write(STDOUT_FILENO, crsr_set_string, strlen(crsr_set_string));
+	term_write(crsr_set_string, strlen(crsr_set_string));
 }
 
-void crsr_yx(int row, int col)
+static void crsr_yx(int row, int col)
 {
 	sprintf(crsr_set_string, "\033[%d;%df", row, col);
-	write(STDOUT_FILENO, crsr_set_string, strlen(crsr_set_string));
+	term_write(crsr_set_string, strlen(crsr_set_string));
 }
 
 static inline void set_scroll_area(void) {
 	sprintf(crsr_set_string, "\033[%d;%dr", 1, term_rows);
-	write(STDOUT_FILENO, crsr_set_string, strlen(crsr_set_string));
+	term_write(crsr_set_string, strlen(crsr_set_string));
 }
 
 #ifndef NO_SIGNALS
 /* Window size change handler */
-void sigwinch_handler(int signum, siginfo_t *sig, void *context)
+static void sigwinch_handler(int signum, siginfo_t *sig, void *context)
+{
+	/* Handled by read_key() outside of signal context */
+	winch_pending = 1;
+	return;
+}
+#endif	/* NO_SIGNALS */
+
+
+/* Adapt to a new terminal size */
+static void handle_resize(void)
 {
-	//fprintf(stderr, "Got a WINCH\n");
-	sleep(1);
+	winch_pending = 0;
 	read_term_dimensions();
+	session_event('r', term_real_rows, term_cols);
 	set_scroll_area();
 	if (crsr_x >= term_cols) crsr_x = term_cols - 1;
 	if (crsr_y >= term_rows) crsr_y = term_rows - 1;
 	crsr_restore();
 	redraw_screen(0, 0);
 	sprintf(custom_status, "Terminal resized to %dx%d", term_cols, term_rows);
+	update_status();
 	return;
 }
-#endif	/* NO_SIGNALS */
 
 
 /* Read terminal dimensions */
 static void read_term_dimensions(void)
 {
 	struct winsize w;
-	ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+
+	if (session_play != NULL) {
+		w.ws_row = session_rows;
+		w.ws_col = session_cols;
+	} else ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
 	term_real_rows = w.ws_row;
 	term_rows = w.ws_row - 1;
 	term_cols = w.ws_col;
@@ -229,25 +852,101 @@ static void read_term_dimensions(void)
 }
 
 
+/* Work out the selected region from the anchor and the cursor */
+static void visual_region(struct region *r)
+{
+	int pos = crsr_x + line_shift - 1;
+
+	r->mode = visual_mode;
+	if (visual_line < cur_line || (visual_line == cur_line && visual_col <= pos)) {
+		r->l1 = visual_line; r->c1 = visual_col;
+		r->l2 = cur_line; r->c2 = pos;
+	} else {
+		r->l1 = cur_line; r->c1 = pos;
+		r->l2 = visual_line; r->c2 = visual_col;
+	}
+	/* A block's columns are the same on every line */
+	if (r->mode == '\026' && r->c1 > r->c2) {
+		pos = r->c1;
+		r->c1 = r->c2;
+		r->c2 = pos;
+	}
+	return;
+}
+
+
+/* The selected bytes [*from, *to) of line 'num' (of length 'len')
+ * Returns 0 if the line isn't in the region. */
+static int region_span(const struct region *r, int num, int len, int *from, int *to)
+{
+	if (num < r->l1 || num > r->l2) return 0;
+	*from = 0;
+	*to = len;
+	if (r->mode == '\026') {
+		*from = r->c1;
+		*to = r->c2 + 1;
+	} else if (r->mode == 'v') {
+		if (num == r->l1) *from = r->c1;
+		if (num == r->l2) *to = r->c2 + 1;
+	}
+	if (*to > len) *to = len;
+	if (*from > *to) *from = *to;
+	return 1;
+}
+
+
 /* Write a line to the screen with appropriate shift */
 static void redraw_line(struct line *line, int y)
 {
+	struct region r;
+	struct fold *f;
+	char summary[80];
 	char *p;
-	int len;
+	int len, from, to;
 
+	if (render_suppressed) return;
 	if (!line) goto error_line_null;
 	if (!line->text) goto error_text_null;
+	STAT_ADD(line_paints, 1);
 	p = line->text + line_shift;
 	len = line->len - line_shift;
 	sprintf(crsr_set_string, "\033[%d;1f", y);
 	//ERASE_TO_EOL();
-	write(STDOUT_FILENO, crsr_set_string, strlen(crsr_set_string));
+	term_write(crsr_set_string, strlen(crsr_set_string));
 	if (len > term_cols) len = term_cols;
-	if (len > 0) write(STDOUT_FILENO, p, len);
-	crsr_yx(y, len + 1);
+	f = fold_closed_at(line, 0);
+	if (f != NULL) {
+		/* A closed fold shows as one summary row */
+		for (p = line->text; *p == ' ' || *p == '\t'; p++);
+		len = snprintf(summary, sizeof(summary), "+--%3d lines: %.60s",
+				f->end_num - f->start_num + 1, p);
+		if (len >= (int)sizeof(summary)) len = sizeof(summary) - 1;
+		if (len > term_cols) len = term_cols;
+		term_write("\033[7m", 4);
+		term_write(summary, len);
+		term_write("\033[m", 3);
+	} else if (len > 0 && visual_mode) {
+		visual_region(&r);
+		if (region_span(&r, row_line(line_row(cur_line) - crsr_y + y),
+					line->len, &from, &to)) {
+			/* Show the selected part in reverse video */
+			from -= line_shift;
+			to -= line_shift;
+			if (from < 0) from = 0;
+			if (to > len) to = len;
+			if (from > to) from = to;
+			term_write(p, from);
+			term_write("\033[7m", 4);
+			term_write(p + from, to - from);
+			term_write("\033[m", 3);
+			term_write(p + to, len - to);
+		} else term_write(p, len);
+	} else if (len > 0) term_write(p, len);
+	/* Erase from where the text ended; tabs make that further along
+	 * than its length */
 	if (len < term_cols) ERASE_TO_EOL();
 	crsr_restore();
-	//write(STDOUT_FILENO, "\n", 1);
+	//term_write("\n", 1);
 	//sleep(1);
 	return;
 
@@ -295,18 +994,270 @@ static inline struct line *walk_to_line(int num,
 		line = line->next;
 		i++;
 	}
+	STAT_ADD(walk_steps, i - 1);
+	return line;
+}
+
+
+/* Find line 'num' in the main buffer, walking from the cursor line
+ * when that is closer than the top of the buffer */
+static struct line *find_line(int num)
+{
+	struct line *line = cur_line_s;
+	int i = cur_line;
+
+	if (num < 1 || num > line_count) return NULL;
+	if (line == NULL || num < (cur_line >> 1)) return walk_to_line(num, line_head);
+	STAT_ADD(walk_steps, num > i ? num - i : i - num);
+	while (i < num && line != NULL) {
+		line = line->next;
+		i++;
+	}
+	while (i > num && line != NULL) {
+		line = line->prev;
+		i--;
+	}
 	return line;
 }
 
 
 /* Out of memory */
-void oom(void) {
+static void oom(void) {
 	strcpy(custom_status, "out of memory");
 	update_status();
 	clean_abort();
 }
 
 
+/* Text that a live snapshot may still see must not be touched */
+#define TEXT_IS_SHARED(line) ((line)->text_epoch <= snap_newest_live)
+
+#ifdef NO_THREADS
+ #define SNAP_REF_ADD(snap, n) ((snap)->refs += (n))
+#else
+ #define SNAP_REF_ADD(snap, n) __atomic_add_fetch(&(snap)->refs, (n), __ATOMIC_ACQ_REL)
+#endif	/* NO_THREADS */
+
+
+/* Line arenas
+ * Compaction copies lines into large chunks, each node followed by its
+ * text sized to fit, in list order. Lines flagged LINE_ARENA_NODE or
+ * LINE_ARENA_TEXT hand their space back to the chunk instead of
+ * free(), and a chunk is freed once nothing in it is still used. */
+#ifdef __ELKS__
+ #define ARENA_CHUNK 8192
+#else
+ #define ARENA_CHUNK (4L << 20)
+#endif	/* __ELKS__ */
+#define ARENA_ALIGN sizeof(void *)
+struct arena {
+	struct arena *next;
+	char *data;
+	size_t size;
+	size_t used;		/* handed out so far */
+	size_t live;		/* handed out and not given back */
+};
+static struct arena *arena_list = NULL;	/* the newest chunk is filled */
+
+
+/* Carve 'size' bytes from the newest chunk, starting a new one if
+ * needed; returns NULL if 'size' is too big for a chunk */
+static void *arena_alloc(size_t size)
+{
+	struct arena *a = arena_list;
+	void *ptr;
+
+	if (size > ARENA_CHUNK - sizeof(struct arena)) return NULL;
+	if (a == NULL || a->used + size > a->size) {
+		a = (struct arena *)vi_malloc(MEM_ARENA, ARENA_CHUNK);
+		if (!a) oom();
+		a->data = (char *)(a + 1);
+		a->size = ARENA_CHUNK - sizeof(struct arena);
+		a->used = 0;
+		a->live = 0;
+		a->next = arena_list;
+		arena_list = a;
+	}
+	ptr = a->data + a->used;
+	a->used += (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	a->live += size;
+	return ptr;
+}
+
+
+/* Give back arena space; the chunk goes once it is all given back */
+static void arena_release(const void *ptr, size_t size)
+{
+	struct arena **ap, *a;
+
+	for (ap = &arena_list; *ap != NULL; ap = &(*ap)->next) {
+		a = *ap;
+		if ((const char *)ptr < a->data || (const char *)ptr >= a->data + a->size) continue;
+		a->live -= size;
+		/* Keep the chunk being filled */
+		if (a->live == 0 && a != arena_list) {
+			*ap = a->next;
+			vi_free(MEM_ARENA, a, ARENA_CHUNK);
+		}
+		return;
+	}
+	oh_dear_god_no("arena_release: not in any arena");
+	return;
+}
+
+
+/* Free a line node wherever it lives */
+static void line_node_free(struct line *line)
+{
+	if (line->flags & LINE_ARENA_NODE) arena_release(line, sizeof(struct line));
+	else vi_free(MEM_NODE, line, sizeof(struct line));
+	return;
+}
+
+
+/* Free a line's text or retire it if a snapshot can still see it */
+static void line_free_text(struct line *line)
+{
+	struct snap_retired *retired;
+
+	if (line->text == NULL) return;
+	if (TEXT_IS_SHARED(line)) {
+		retired = (struct snap_retired *)vi_malloc(MEM_SNAP, sizeof(struct snap_retired));
+		if (!retired) oom();
+		retired->text = line->text;
+		retired->size = line->alloc_size;
+		retired->in_arena = (line->flags & LINE_ARENA_TEXT) != 0;
+		retired->epoch = buf_epoch - 1;
+		retired->next = snap_retired_list;
+		snap_retired_list = retired;
+	} else if (line->flags & LINE_ARENA_TEXT) arena_release(line->text, line->alloc_size);
+	else vi_free(MEM_TEXT, line->text, line->alloc_size);
+	line->text = NULL;
+	line->flags &= ~LINE_ARENA_TEXT;
+	return;
+}
+
+
+/* Give a line private text before it is modified */
+static void line_cow(struct line *line)
+{
+	char *new_text;
+
+	if (!TEXT_IS_SHARED(line)) return;
+	new_text = (char *)vi_malloc(MEM_TEXT, line->alloc_size);
+	if (!new_text) oom();
+	memcpy(new_text, line->text, line->len + 1);
+	line_free_text(line);
+	line->text = new_text;
+	line->text_epoch = buf_epoch;
+	return;
+}
+
+
+/* Bytes in chunk 'c' of a snapshot of 'count' lines */
+static size_t snap_chunk_size(int count, int c)
+{
+	if (count - c * SNAP_CHUNK < SNAP_CHUNK)
+		return (count - c * SNAP_CHUNK) * sizeof(struct snap_line);
+	return SNAP_CHUNK * sizeof(struct snap_line);
+}
+
+
+/* Free a snapshot and its chunks */
+static void snap_free(struct snapshot *snap)
+{
+	int c;
+
+	for (c = 0; c * SNAP_CHUNK < snap->line_count; c++)
+		vi_free(MEM_SNAP, snap->chunks[c], snap_chunk_size(snap->line_count, c));
+	vi_free(MEM_SNAP, snap, snap->size);
+	return;
+}
+
+
+/* Free dropped snapshots and any text no live snapshot can see */
+static void snap_reclaim(void)
+{
+	struct snapshot **snapp, *snap;
+	struct snap_retired **retp, *ret;
+	unsigned int oldest = 0;
+
+	snap_newest_live = 0;
+	snapp = &snap_list;
+	while (*snapp != NULL) {
+		snap = *snapp;
+		if (SNAP_REF_ADD(snap, 0) == 0) {
+			*snapp = snap->next;
+			snap_free(snap);
+			continue;
+		}
+		if (oldest == 0 || snap->epoch < oldest) oldest = snap->epoch;
+		if (snap->epoch > snap_newest_live) snap_newest_live = snap->epoch;
+		snapp = &snap->next;
+	}
+
+	retp = &snap_retired_list;
+	while (*retp != NULL) {
+		ret = *retp;
+		if (oldest == 0 || ret->epoch < oldest) {
+			*retp = ret->next;
+			if (ret->in_arena) arena_release(ret->text, ret->size);
+			else vi_free(MEM_TEXT, ret->text, ret->size);
+			vi_free(MEM_SNAP, ret, sizeof(struct snap_retired));
+			continue;
+		}
+		retp = &ret->next;
+	}
+	return;
+}
+
+
+/* Take a snapshot of the 'count' lines starting at '*from', which is
+ * left at the line after them; release it with snap_put() */
+static struct snapshot *snap_take(struct line **from, int count)
+{
+	struct snapshot *snap;
+	struct line *line;
+	size_t size;
+	int chunks, c, i;
+
+	snap_reclaim();
+	chunks = (count + SNAP_CHUNK - 1) / SNAP_CHUNK;
+	size = sizeof(struct snapshot) + chunks * sizeof(struct snap_line *);
+	snap = (struct snapshot *)vi_malloc(MEM_SNAP, size);
+	if (!snap) oom();
+	snap->size = size;
+	snap->chunks = (struct snap_line **)(snap + 1);
+	snap->line_count = count;
+	for (c = 0; c < chunks; c++) {
+		snap->chunks[c] = (struct snap_line *)vi_malloc(MEM_SNAP,
+				snap_chunk_size(count, c));
+		if (!snap->chunks[c]) oom();
+	}
+	snap->refs = 1;
+	snap->epoch = buf_epoch++;
+	line = *from;
+	for (i = 0; i < count; line = line->next) {
+		SNAP_LINE(snap, i)->text = line->text;
+		SNAP_LINE(snap, i)->len = line->len;
+		i++;
+	}
+	*from = line;
+	snap->next = snap_list;
+	snap_list = snap;
+	snap_newest_live = snap->epoch;
+	return snap;
+}
+
+
+/* Drop a reference to a snapshot (safe from any thread) */
+static void snap_put(struct snapshot *snap)
+{
+	SNAP_REF_ADD(snap, -1);
+	return;
+}
+
+
 /* Allocate a new line after the selected line */
 static struct line *alloc_new_line(int start,
 		const char * const restrict new_text,
@@ -319,11 +1270,12 @@ static struct line *alloc_new_line(int start,
 	/* Cannot open lines out of current range */
 	if (start > *buf_line_count) return NULL;
 
-	if (start > 0) prev_line = walk_to_line(start, *buf_head);
+	if (start > 0) prev_line = (buf_head == &line_head) ?
+			find_line(start) : walk_to_line(start, *buf_head);
 	else prev_line = *buf_head;
 
 	/* Insert a new line */
-	new_line = (struct line *)malloc(sizeof(struct line));
+	new_line = (struct line *)vi_malloc(MEM_NODE, sizeof(struct line));
 	if (!new_line) oom();
 	if (prev_line == NULL) {
 		/* If buf_head is NULL, no lines exist yet */
@@ -343,9 +1295,11 @@ static struct line *alloc_new_line(int start,
 	if (new_line->next != NULL) new_line->next->prev = new_line;
 
 	/* Allocate the text area (if applicable) */
+	new_line->text_epoch = buf_epoch;
+	new_line->flags = 0;
 	if (new_text == NULL) {
 		new_line->len = 0;
-		new_line->text = (char *)calloc(1, 32);
+		new_line->text = (char *)vi_calloc(MEM_TEXT, 1, 32);
 		if (!new_line->text) oom();
 		new_line->alloc_size = 32;
 	} else {
@@ -356,12 +1310,14 @@ static struct line *alloc_new_line(int start,
 		new_ll = ((new_line->len + 1) >> 5) + 1;
 		new_ll <<= 5;
 		new_line->alloc_size = new_ll;
-		new_line->text = (char *)calloc(1, new_ll);
+		new_line->text = (char *)vi_calloc(MEM_TEXT, 1, new_ll);
 		if (!new_line->text) oom();
 		strcpy(new_line->text, new_text);
 	}
 
 	*buf_line_count += 1;
+	if (buf_head == &line_head)
+		fold_lines_added(start > 0 ? start : (prev_line != NULL), 1, new_line);
 
 	return new_line;
 }
@@ -396,79 +1352,185 @@ return 0; /* FIXME: finish this code */
 }
 
 
-/* Destroy and free one line in the line list */
-static int destroy_line(struct line *target_line)
+/* Point every mark at 'from' to 'to' instead (NULL clears them) */
+static void marks_move(const struct line *from, struct line *to)
 {
-	struct line *temp_line;
+	int i;
 
-	if (target_line == NULL) return -1;
-	if (target_line->prev != NULL) {
-		if (target_line->text != NULL) free(target_line->text);
-		/* Detach the line to be destroyed from the list */
-		target_line->prev->next = target_line->next;
-		if (target_line->next != NULL)
-			target_line->next->prev = target_line->prev;
-		/* Jump to the next line and destroy the previous one */
-		free(target_line);
-		line_count--;
-	} else {
-		/* Line 1 must be handled differently */
-		if (line_count > 1) {
-			if (target_line->next == NULL) goto error_line_null;
-			temp_line = target_line;
-			target_line = target_line->next;
-			target_line->prev = NULL;
-			if (temp_line->text != NULL) free(temp_line->text);
-			free(temp_line);
-			/* Update line_head if we just destroyed it */
-			if ((uintptr_t)temp_line == (uintptr_t)line_head)
-				line_head = target_line;
-			line_count--;
-		} else {
-			/* Line 1 with no more lines */
-			target_line->len = 0;
-			/* Warn if user tried to delete the only empty line */
-			if (*target_line->text == '\0') return 1;
-			*(target_line->text) = '\0';
+	for (i = 0; i < 26; i++) if (marks[i].line == from) marks[i].line = to;
+	for (i = 0; i < jump_len; i++) if (jump_list[i].line == from) jump_list[i].line = to;
+	if (mark_prev.line == from) mark_prev.line = to;
+	if (to != NULL) to->flags |= LINE_MARKED;
+	return;
+}
+
+
+/* Drop any fold that starts or ends at a line being freed */
+static void fold_forget(const struct line *line)
+{
+	int i, j;
+
+	for (i = j = 0; i < fold_count; i++) {
+		if (folds[i].start == line || folds[i].end == line) {
+			if (folds[i].closed) folds_closed--;
+			continue;
 		}
+		folds[j++] = folds[i];
 	}
+	fold_count = j;
+	return;
+}
 
-	redraw_screen(0, 0);
 
-	return 0;
+/* Hand the folds at one line over to another that replaced it */
+static void fold_move(const struct line *from, struct line *to)
+{
+	int i;
 
-error_line_null:
-	fprintf(stderr, "error: line 1 next ptr = NULL but line_count > 1\n");
-	clean_abort();
-	return -1;
+	for (i = 0; i < fold_count; i++) {
+		if (folds[i].start == from) folds[i].start = to;
+		if (folds[i].end == from) folds[i].end = to;
+	}
+	to->flags |= LINE_FOLD;
+	return;
 }
 
 
-/* Destroy every line in the selected buffer
- * This is used to empty the yank buffer and to de-allocate the line buffer
- * on program exit; use it like this: destroy_buffer(&buffer_head); */
-static void destroy_buffer(struct line **head)
+/* Renumber the folds after 'count' lines from line 'start' on were
+ * unlinked ('lines' is the detached list); folds whose first or last
+ * line went are dropped and those around the change shrink */
+static void fold_lines_removed(int start, int count, const struct line *lines)
 {
-	struct line *line = *head;
-	struct line *prev = NULL;
+	int i, last = start + count - 1;
+
+	if (fold_count == 0) return;
+	for (; lines != NULL; lines = lines->next)
+		if (lines->flags & LINE_FOLD) fold_forget(lines);
+	/* An end that fold_move() handed to a line about to be linked in
+	 * waits at 'start' for fold_lines_added() to number it */
+	for (i = 0; i < fold_count; i++) {
+		if (folds[i].start_num > last) folds[i].start_num -= count;
+		else if (folds[i].start_num > start) folds[i].start_num = start;
+		if (folds[i].end_num > last) folds[i].end_num -= count;
+		else if (folds[i].end_num > start) folds[i].end_num = start;
+	}
+	return;
+}
 
-	*head = NULL;
 
-	/* Free lines in order until list is exhausted */
-	while (line != NULL) {
-		if (line->text != NULL) free(line->text);
-		if (line->prev != NULL) free(line->prev);
-		prev = line;
-		line = line->next;
+/* Renumber the folds after 'count' lines starting with 'lines' were
+ * linked in after line 'after' */
+static void fold_lines_added(int after, int count, const struct line *lines)
+{
+	int i, num;
+
+	if (fold_count == 0) return;
+	for (i = 0; i < fold_count; i++) {
+		if (folds[i].start_num > after) folds[i].start_num += count;
+		if (folds[i].end_num > after) folds[i].end_num += count;
 	}
-	/* Free the final line, if applicable */
-	if (prev != NULL) free(prev);
+	for (num = after + 1; num <= after + count; num++, lines = lines->next) {
+		if (!(lines->flags & LINE_FOLD)) continue;
+		for (i = 0; i < fold_count; i++) {
+			if (folds[i].start == lines) folds[i].start_num = num;
+			if (folds[i].end == lines) folds[i].end_num = num;
+		}
+	}
+	return;
 }
 
-static void update_status(void)
+
+/* The closed fold starting (or with 'at_end', ending) at 'line' */
+static struct fold *fold_closed_at(const struct line *line, int at_end)
 {
-	char num[4];
-	int top_line;
+	int i;
+
+	if (line == NULL || !(line->flags & LINE_FOLD) || folds_closed == 0) return NULL;
+	for (i = 0; i < fold_count; i++) {
+		if (!folds[i].closed) continue;
+		if ((at_end ? folds[i].end : folds[i].start) == line) return &folds[i];
+	}
+	return NULL;
+}
+
+
+/* The fold holding line 'num' (a closed one only, if 'closed' is set) */
+static struct fold *fold_holding(int num, int closed)
+{
+	int i;
+
+	for (i = 0; i < fold_count && folds[i].start_num <= num; i++) {
+		if (closed && !folds[i].closed) continue;
+		if (folds[i].end_num >= num) return &folds[i];
+	}
+	return NULL;
+}
+
+
+/* The screen row line 'num' would be on if line 1 were on row 1 */
+static int line_row(int num)
+{
+	int i, row = num;
+
+	if (folds_closed == 0) return num;
+	for (i = 0; i < fold_count && folds[i].start_num < num; i++) {
+		if (!folds[i].closed) continue;
+		if (folds[i].end_num < num) row -= folds[i].end_num - folds[i].start_num;
+		else row -= num - folds[i].start_num;
+	}
+	return row;
+}
+
+
+/* The line shown on 'row' (the inverse of line_row()) */
+static int row_line(int row)
+{
+	int i, num = row;
+
+	if (folds_closed == 0) return row;
+	for (i = 0; i < fold_count && folds[i].start_num < num; i++)
+		if (folds[i].closed) num += folds[i].end_num - folds[i].start_num;
+	return num;
+}
+
+
+/* Line number of the top row of the screen */
+static int screen_top(void)
+{
+	if (folds_closed == 0) return cur_line - crsr_y + 1;
+	return row_line(line_row(cur_line) - crsr_y + 1);
+}
+
+
+/* Destroy every line in the selected buffer
+ * This is used to empty the yank buffer and to de-allocate the line buffer
+ * on program exit; use it like this: destroy_buffer(&buffer_head); */
+static void destroy_buffer(struct line **head)
+{
+	struct line *line = *head;
+	struct line *prev = NULL;
+
+	*head = NULL;
+
+	/* Free lines in order until list is exhausted */
+	while (line != NULL) {
+		if (line->flags & LINE_MARKED) marks_move(line, NULL);
+		if (line->flags & LINE_FOLD) fold_forget(line);
+		line_free_text(line);
+		if (line->prev != NULL) line_node_free(line->prev);
+		prev = line;
+		line = line->next;
+	}
+	/* Free the final line, if applicable */
+	if (prev != NULL) line_node_free(prev);
+}
+
+static void update_status(void)
+{
+	char num[24];
+	int top_line;
+
+	if (render_suppressed) return;
 
 	/* Move the cursor to the last line */
 	crsr_yx(term_real_rows, 0);
@@ -477,22 +1539,27 @@ static void update_status(void)
 	/* Print the current insert/replace mode or special status */
 	if (*custom_status == '\0')
 		strncpy(custom_status, mode_string[vi_mode], MAX_STATUS);
-	write(STDOUT_FILENO, custom_status, strlen(custom_status));
+	term_write(custom_status, strlen(custom_status));
 	*custom_status = '\0';
+	if (macro_recording >= 0) {
+		sprintf(num, " recording @%c", 'a' + macro_recording);
+		term_write(num, strlen(num));
+	}
 
 	/* Print our location in the current line and file */
 	crsr_yx(term_real_rows, term_cols - 16);
-	printf("%d,%d", cur_line, crsr_x + line_shift);
+	sprintf(num, "%d,%d", cur_line, crsr_x + line_shift);
+	term_write(num, strlen(num));
 	crsr_yx(term_real_rows, term_cols - 5);
-	top_line = 1 + (cur_line - crsr_y);
+	top_line = screen_top();
 	if (top_line < 1) goto error_top_line;
 	if (top_line == 1) {
-		write(STDOUT_FILENO, " Top", 4);
-	} else if ((cur_line + term_rows) >= line_count) {
-		write(STDOUT_FILENO, " Bot", 4);
+		term_write(" Top", 4);
+	} else if ((line_row(cur_line) + term_rows) >= line_row(line_count)) {
+		term_write(" Bot", 4);
 	} else {
-		sprintf(num, "%d%%", (line_count * 100) / top_line);
-		write(STDOUT_FILENO, num, strlen(num));
+		sprintf(num, "%d%%", (int)(((long)top_line * 100) / line_count));
+		term_write(num, strlen(num));
 	}
 
 	/* Put the cursor back where it was before we touched it */
@@ -511,22 +1578,28 @@ error_top_line:
 static void redraw_screen(int row_start, int row_end)
 {
 	struct line *line;
+	struct fold *f;
 	int start_y;
 	int this_row;
 
-	if (cur_line < crsr_y) goto error_line_cursor;
+	if (render_suppressed) return;
+	if (line_row(cur_line) < crsr_y) goto error_line_cursor;
 	if (row_start > term_rows) goto error_row_params;
 
 	if (row_start <= 0) row_start = 1;
 	if (row_end <= 0) row_end = term_rows;
 
-	if (row_start == 1 && row_end == term_rows) CLEAR_SCREEN();
+	TRACE_BEGIN("redraw");
+	if (row_start == 1 && row_end == term_rows) {
+		CLEAR_SCREEN();
+		STAT_ADD(full_redraws, 1);
+	} else STAT_ADD(partial_redraws, 1);
 
 	/* Get start line number and pointer */
-	start_y = cur_line - crsr_y + row_start;
+	start_y = row_line(line_row(cur_line) - crsr_y + row_start);
 
 	/* Find the first line to write to the screen */
-	line = walk_to_line(start_y, line_head);
+	line = find_line(start_y);
 	if (!line) goto error_line_walk;
 //	fprintf(stderr, "line walk: start_y %d, line_head %p, line %p, line->next %p, re %u, rs %u\n", start_y, line_head, line, line->next, row_end, row_start);
 //	clean_abort();
@@ -539,19 +1612,23 @@ static void redraw_screen(int row_start, int row_end)
 		redraw_line(line, this_row);
 		this_row++;
 		crsr_yx(this_row, 1);
+		/* Hop over the lines a closed fold hides */
+		f = fold_closed_at(line, 0);
+		if (f != NULL) line = f->end;
 		line = line->next;
 		if (line == NULL) break;
 	}
 
 	/* Fill the rest of the screen with tildes */
 	while (this_row <= row_end) {
-		write(STDOUT_FILENO, "~\n", 2);
+		term_write("~\n", 2);
 		this_row++;
 	}
 
 	//update_status();
 	//CRSR_HOME();
 	crsr_restore();
+	TRACE_END("redraw");
 
 	return;
 
@@ -569,481 +1646,4449 @@ error_line_walk:
 }
 
 
-/* Delete char at cursor location */
-static int do_del_under_crsr(int left)
+/* Show a report over the text until a key is pressed */
+static void report_show(const char *text)
 {
-	char *p;
-
-	if (cur_line_s->len == 0) return 1;
-	if (crsr_x > (cur_line_s->len + line_shift) && left == 0) return 1;
-	p = cur_line_s->text + crsr_x + line_shift;
+	const char *p, *nl;
+	char c;
+	int row = 1;
 
-	/* Copy everything down one char */
-	memmove(p - 1, p, strlen(p) + 1);
-	cur_line_s->len--;
-	if (crsr_x > (cur_line_s->len - line_shift) + (vi_mode > 0 ? 1 : 0)) crsr_x--;
-	if (crsr_x < 1) {
-		if (line_shift > 0) line_shift_reduce(1);
-		crsr_x = 1;
+	if (render_suppressed) return;
+	CLEAR_SCREEN();
+	for (p = text; *p != '\0' && row < term_real_rows; p = nl, row++) {
+		nl = strchr(p, '\n');
+		if (nl == NULL) nl = p + strlen(p);
+		crsr_yx(row, 1);
+		term_write(p, (nl - p > term_cols) ? term_cols : nl - p);
+		if (*nl == '\n') nl++;
 	}
-	redraw_line(cur_line_s, crsr_y);
-	crsr_restore();
-	return 0;
+	crsr_yx(term_real_rows, 1);
+	term_write("Press any key to continue", 25);
+	read_key(&c);
+	redraw_screen(0, 0);
+	return;
 }
 
 
-static void go_to_start_of_next_line(void)
+/* Format the performance counters as a report */
+static void stats_format(char *buf, int size)
 {
-	do_cursor_down();
-	line_shift = 0;
-	crsr_x = 1;
-	crsr_restore();
-	update_status();
+	snprintf(buf, size,
+			"keys read        %lu\n"
+			"read() calls     %lu\n"
+			"write() calls    %lu\n"
+			"bytes written    %lu\n"
+			"malloc/calloc    %lu\n"
+			"realloc          %lu\n"
+			"free             %lu\n"
+			"bytes requested  %lu\n"
+			"line walk steps  %lu\n"
+			"full redraws     %lu\n"
+			"partial redraws  %lu\n"
+			"lines painted    %lu\n"
+			"line nodes       %ld (%d in the buffer)\n",
+			stats.keys, stats.reads, stats.writes, stats.write_bytes,
+			stats.mallocs, stats.reallocs, stats.frees, stats.alloc_bytes,
+			stats.walk_steps, stats.full_redraws, stats.partial_redraws,
+			stats.line_paints, mem_usage[MEM_NODE].blocks, line_count);
 	return;
 }
 
 
-/* Restore terminal to original configuration */
-static void term_restore(void)
+/* :stats */
+static void stats_show(void)
 {
-	if (termdesc != -1) tcsetattr(termdesc, TCSANOW, &term_orig);
-	ENABLE_LINE_WRAP();
+	char buf[1024];
+
+	stats_format(buf, sizeof(buf));
+	report_show(buf);
 	return;
 }
 
-/* Initialize terminal settings */
-static int term_init(void)
-{
-	/* Only init terminal once */
-	if (termdesc != -1) return 0;
 
-	/* Find a std* stream with a TTY */
-	if (isatty(STDIN_FILENO)) termdesc = STDIN_FILENO;
-	else if (isatty(STDOUT_FILENO)) termdesc = STDOUT_FILENO;
-	else if (isatty(STDERR_FILENO)) termdesc = STDERR_FILENO;
-	else return -ENOTTY;
+/* Append a report to the file named by environment variable 'var'
+ * ("-" means stderr); nothing is written if it isn't set */
+static void report_save(const char *var, const char *text)
+{
+	const char *path = getenv(var);
+	FILE *fp;
 
-	/* Get current terminal configuration and save it*/
-	if (tcgetattr(termdesc, &term_orig)) return -EBADF;
-	memcpy(&term_config, &term_orig, sizeof(struct termios));
+	if (path == NULL || *path == '\0') return;
+	if (strcmp(path, "-") == 0) {
+		fputs(text, stderr);
+		return;
+	}
+	fp = fopen(path, "a");
+	if (fp == NULL) return;
+	fputs(text, fp);
+	fclose(fp);
+	return;
+}
 
-	/* Disable buffering */
-	if (isatty(STDIN_FILENO)) setvbuf(stdin, NULL, _IONBF, 0);
-	if (isatty(STDOUT_FILENO)) setvbuf(stdout, NULL, _IONBF, 0);
-	if (isatty(STDERR_FILENO)) setvbuf(stderr, NULL, _IONBF, 0);
 
-	/* Configure terminal settings */
+/* Write the counters to the file named by VI_STATS on exit */
+static void stats_dump(void)
+{
+	char buf[1024];
 
-	/* c_cc */
-	term_config.c_cc[VTIME] = 0;
-	term_config.c_cc[VMIN] = 1;	/* read() one char at a time*/
+	if (getenv("VI_STATS") == NULL) return;
+	stats_format(buf, sizeof(buf));
+	report_save("VI_STATS", buf);
+	return;
+}
 
-	/* iflag */
-#ifdef IUCLC
-	term_config.c_iflag &= ~IUCLC;
-#endif
-	term_config.c_iflag &= ~PARMRK;
-	term_config.c_iflag |= IGNPAR;
-	term_config.c_iflag &= ~IGNBRK;
-	term_config.c_iflag |= BRKINT;
-	term_config.c_iflag &= ~ISTRIP;
-	term_config.c_iflag &= ~(INLCR | IGNCR | ICRNL);
 
-	/* cflag */
-	term_config.c_cflag &= ~CSIZE;
-	term_config.c_cflag |= CS8;
-	term_config.c_cflag |= CREAD;
+/* Keystroke-to-paint latency
+ * Every key is timestamped as it is read from the terminal. When the
+ * frame is flushed and the editor is about to wait for input again,
+ * each pending key's latency goes into a log-bucketed histogram: 16
+ * linear buckets per power of two, so any value is within about 6%. */
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((32 - LAT_SUB_BITS + 1) * LAT_SUB)
+#define LAT_PENDING 64
+static unsigned long lat_hist[LAT_BUCKETS];
+static unsigned long lat_samples = 0;
+static unsigned long lat_max = 0;
+static unsigned long lat_pending[LAT_PENDING];
+static int lat_pending_len = 0;
+
+
+/* Remember when a key arrived */
+static void latency_key(void)
+{
+	if (lat_pending_len < LAT_PENDING)
+		lat_pending[lat_pending_len++] = now_usec();
+	return;
+}
 
-	/* lflag */
-	term_config.c_lflag |= ISIG;
-	term_config.c_lflag &= ~ICANON;	/* disable line buffering */
-	term_config.c_lflag &= ~IEXTEN;
 
-	/* disable local echo */
-	term_config.c_lflag &= ~(ECHO | ECHONL | ECHOE | ECHOK);
+static int latency_bucket(unsigned long usec)
+{
+	int shift = 0;
 
-	/* Finalize settings */
-	tcsetattr(termdesc, TCSANOW, &term_config);
+	if (usec >= 0xffffffffUL) usec = 0xffffffffUL;
+	if (usec < LAT_SUB * 2) return (int)usec;
+	while ((usec >> shift) >= LAT_SUB * 2) shift++;
+	return (shift + 1) * LAT_SUB + (int)(usec >> shift) - LAT_SUB;
+}
 
-	/* Disable automatic line wrapping */
-	DISABLE_LINE_WRAP();
 
-	set_scroll_area();
+/* Largest value that lands in a bucket */
+static unsigned long latency_bucket_top(int bucket)
+{
+	int shift;
 
-	return 0;
+	if (bucket < LAT_SUB * 2) return bucket;
+	shift = bucket / LAT_SUB - 1;
+	return (((unsigned long)(bucket % LAT_SUB + LAT_SUB + 1)) << shift) - 1;
 }
 
-/* Clean abort */
-static void clean_abort(void)
+
+/* The frame is on the terminal: record the keys it answered */
+static void latency_frame_done(void)
 {
-	term_restore();
-	destroy_buffer(&line_head);
-	destroy_buffer(&yank_head);
-	exit(EXIT_FAILURE);
+	unsigned long now, usec;
+	int i;
+
+	if (lat_pending_len == 0) return;
+	now = now_usec();
+	for (i = 0; i < lat_pending_len; i++) {
+		usec = now - lat_pending[i];
+		lat_hist[latency_bucket(usec)]++;
+		lat_samples++;
+		if (usec > lat_max) lat_max = usec;
+	}
+	lat_pending_len = 0;
+	return;
 }
 
 
-void insert_char(char c)
+/* Latency below which 'permille' thousandths of the samples fall */
+static unsigned long latency_percentile(int permille)
 {
-	char *new_text;
-	char *p;
-
-	switch (vi_mode) {
-	case 1:	/* insert mode */
-		if (cur_line_s->alloc_size == (cur_line_s->len)) {
-			/* Allocate a larger buffer and insert to that */
-			new_text = (char *)realloc(cur_line_s->text, cur_line_s->len << 1);
-			if (!new_text) oom();
-			cur_line_s->text = new_text;
-			cur_line_s->alloc_size = cur_line_s->len << 1;
-		}
-		/* Move text up by one byte */
-		p = cur_line_s->text + crsr_x + line_shift - 1;
-		memmove(p + 1, p, strlen(p) + 1);
-		*p = c;
-		if (crsr_x > term_cols) line_shift_increase(1);
-		else crsr_x++;
-		cur_line_s->len++;
-		return;
+	unsigned long want, seen = 0, top;
+	int i;
 
-	case 2: /* replace mode */
-		return;
+	if (lat_samples == 0) return 0;
+	want = (lat_samples * permille + 999) / 1000;
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		seen += lat_hist[i];
+		if (seen >= want) break;
 	}
+	top = latency_bucket_top(i);
+	return (top > lat_max) ? lat_max : top;
+}
 
+
+/* Format the percentiles, then the non-empty buckets if 'buckets' */
+static void latency_format(char *buf, int size, int buckets)
+{
+	int i, len;
+
+	len = snprintf(buf, size,
+			"keystrokes       %lu\n"
+			"p50              %lu us\n"
+			"p99              %lu us\n"
+			"p99.9            %lu us\n"
+			"max              %lu us\n",
+			lat_samples, latency_percentile(500), latency_percentile(990),
+			latency_percentile(999), lat_max);
+	for (i = 0; buckets && i < LAT_BUCKETS && len < size; i++) {
+		if (lat_hist[i] == 0) continue;
+		len += snprintf(buf + len, size - len, "<= %lu us\t%lu\n",
+				latency_bucket_top(i), lat_hist[i]);
+	}
 	return;
 }
 
 
-/* Editing mode. Doesn't return until ESC pressed. */
-void edit_mode(void)
+/* :latency */
+static void latency_show(void)
 {
-	unsigned char c;
-	char *fragment;
-
-	while (read(STDIN_FILENO, &c, 1)) {
-		switch (c) {
-		case '\0':
-			continue;
+	char buf[256];
 
-		case '\b':
-		case 0x7f:
-			if (crsr_x > 1) {
-				crsr_x--;
-				/* FIXME: Add joining of lines on backspace */
-				do_del_under_crsr(1);
-			}
-			continue;
+	latency_format(buf, sizeof(buf), 0);
+	report_show(buf);
+	return;
+}
 
-		case '\n':
-		case '\r':	/* New line */
-			fragment = cur_line_s->text + line_shift + crsr_x - 1;
-//			sprintf(custom_status, "txt %p, adjtxt %p, ls+cx %d+%d",
-//					cur_line_s->text, fragment, line_shift, crsr_x);
 
-			if (!alloc_new_line(cur_line, fragment, &line_count, &line_head)) oom();
+/* Write the histogram to the file named by VI_LATENCY on exit */
+static void latency_dump(void)
+{
+	char buf[LAT_BUCKETS * 32 + 256];
 
-			/* New lines need to break the old line apart */
-			if (*fragment != '\0') {
-				cur_line_s->len = line_shift + crsr_x - 1;
-				*fragment = '\0';
-			}
-			go_to_start_of_next_line();
-			redraw_screen(crsr_y, 0);
-			continue;
+	if (getenv("VI_LATENCY") == NULL) return;
+	latency_format(buf, sizeof(buf), 1);
+	report_save("VI_LATENCY", buf);
+	return;
+}
 
-		case '\033':
-			/* FIXME: poll for ESC sequences */
-			goto end_edit_mode;
 
-		default:
-			break;
-		}
+/* Add up the lines of a list for :mem */
+struct mem_lines {
+	long lines;
+	long used;
+	long alloc;
+};
 
-		/* Catch any invalid characters */
-		if (c < 32 || c > 127) {
-			sprintf(custom_status, "Invalid char entered: %u", c);
-			update_status();
-			continue;
-		}
-		/* Insert character at cursor position */
-		insert_char(c);
-		redraw_line(cur_line_s, crsr_y);
-		crsr_restore();
-		update_status();
+static void mem_count_lines(const struct line *line, struct mem_lines *m)
+{
+	for (; line != NULL; line = line->next) {
+		m->lines++;
+		m->used += line->len + 1;
+		m->alloc += line->alloc_size;
 	}
+	return;
+}
 
-end_edit_mode:
-	if (crsr_x > 1) crsr_x--;
-	vi_mode = MODE_COMMAND;
-	update_status();
+
+/* :mem shows live and peak bytes for each subsystem, the slack in
+ * what is allocated but unused where that is known, and who holds the
+ * line memory */
+static void mem_show(void)
+{
+	struct mem_lines held[3];
+	const struct undo_rec *rec;
+	const struct arena *a;
+	long slack[MEM_TAGS];
+	long live = 0, peak = 0;
+	char buf[2048];
+	int i, len;
+	static const char * const holder[3] = { "buffer", "yank", "undo/redo" };
+
+	memset(held, 0, sizeof(held));
+	memset(slack, 0, sizeof(slack));
+	mem_count_lines(line_head, &held[0]);
+	mem_count_lines(yank_head, &held[1]);
+	for (rec = undo_list; rec != NULL; rec = rec->next) mem_count_lines(rec->lines, &held[2]);
+	for (rec = redo_list; rec != NULL; rec = rec->next) mem_count_lines(rec->lines, &held[2]);
+	for (i = 0; i < 3; i++) slack[MEM_TEXT] += held[i].alloc - held[i].used;
+	slack[MEM_MACRO] = record_alloc - record_len;
+	slack[MEM_EDIT] = (last_change.text_alloc - last_change.text_len)
+			+ (replace_save_alloc - replace_saved);
+	slack[MEM_FOLD] = (long)((fold_alloc - fold_count) * sizeof(struct fold));
+	for (a = arena_list; a != NULL; a = a->next) slack[MEM_ARENA] += (long)(a->size - a->live);
+
+	len = snprintf(buf, sizeof(buf), "%-14s %12s %12s %9s %12s\n",
+			"", "live", "peak", "blocks", "slack");
+	for (i = 0; i < MEM_TAGS; i++) {
+		len += snprintf(buf + len, sizeof(buf) - len, "%-14s %12ld %12ld %9ld %12ld\n",
+				mem_tag_name[i], mem_usage[i].live, mem_usage[i].peak,
+				mem_usage[i].blocks, slack[i]);
+		live += mem_usage[i].live;
+		peak += mem_usage[i].peak;
+	}
+	len += snprintf(buf + len, sizeof(buf) - len, "%-14s %12ld %12ld\n\n%-14s %12s %12s %9s\n",
+			"total", live, peak, "lines held by", "text used", "allocated", "lines");
+	for (i = 0; i < 3; i++)
+		len += snprintf(buf + len, sizeof(buf) - len, "%-14s %12ld %12ld %9ld\n",
+				holder[i], held[i].used, held[i].alloc, held[i].lines);
+	report_show(buf);
 	return;
 }
 
 
-/* Get a free-form command string from the user */
-static int get_command_string(char *command)
+/* Compaction: copy 'count' lines from line 'start' into the arenas in
+ * list order, text sized to fit, and free the old copies. Text that a
+ * snapshot can still see is retired as usual. Returns the bytes of
+ * slack given back. */
+static long compact_lines(int start, int count)
 {
-	int cmdsize = 0;
-	char cc;
+	struct line *old, *line, *next;
+	char *text;
+	long slack = 0;
+	int i;
 
-	while (read(STDIN_FILENO, &cc, 1)) {
-		/* If user presses ESC, abort */
-		if (cc == '\033') {
-			command[0] = '\0';
-			return 0;
-		}
+	old = find_line(start);
+	for (i = 0; i < count && old != NULL; i++, old = next) {
+		next = old->next;
+		line = (struct line *)arena_alloc(sizeof(struct line));
+		*line = *old;
+		line->flags |= LINE_ARENA_NODE;
+		text = (char *)arena_alloc(old->len + 1);
+		if (text != NULL) {
+			memcpy(text, old->text, old->len + 1);
+			slack += old->alloc_size - (old->len + 1);
+			line_free_text(old);
+			line->text = text;
+			line->alloc_size = old->len + 1;
+			line->text_epoch = buf_epoch;
+			line->flags |= LINE_ARENA_TEXT;
+		} else old->text = NULL;	/* too long: the text stays */
+		if (old->prev != NULL) old->prev->next = line;
+		else line_head = line;
+		if (next != NULL) next->prev = line;
+		if (old == cur_line_s) cur_line_s = line;
+		if (old->flags & LINE_MARKED) marks_move(old, line);
+		if (old->flags & LINE_FOLD) fold_move(old, line);
+		line_node_free(old);
+	}
+	return slack;
+}
 
-		/* Backspace */
-		if (cc == '\b' || cc == 0x7f) {
-			command[cmdsize] = '\0';
+
+/* :compact over a range, or the whole buffer without one */
+static int ex_compact(char *command, int ranged, int first, int last)
+{
+	long slack;
+
+	if (strcmp(command, "compact") != 0) return 0;
+	if (!ranged) {
+		first = 1;
+		last = line_count;
+	}
+	slack = compact_lines(first, last - first + 1);
+#ifdef __GLIBC__
+	/* Hand the freed heap back to the system */
+	malloc_trim(0);
+#endif	/* __GLIBC__ */
+	snprintf(custom_status, MAX_STATUS, "Compacted %d lines, %ld bytes of slack freed",
+			last - first + 1, slack);
+	return 1;
+}
+
+
+/* Delete char at cursor location */
+static int do_del_under_crsr(int left)
+{
+	char *p;
+
+	if (cur_line_s->len == 0) return 1;
+	if (crsr_x > (cur_line_s->len + line_shift) && left == 0) return 1;
+	line_cow(cur_line_s);
+	p = cur_line_s->text + crsr_x + line_shift;
+
+	/* Copy everything down one char */
+	memmove(p - 1, p, strlen(p) + 1);
+	cur_line_s->len--;
+	if (crsr_x > (cur_line_s->len - line_shift) + (vi_mode > 0 ? 1 : 0)) crsr_x--;
+	if (crsr_x < 1) {
+		if (line_shift > 0) line_shift_reduce(1);
+		crsr_x = 1;
+	}
+	redraw_line(cur_line_s, crsr_y);
+	crsr_restore();
+	return 0;
+}
+
+
+static void go_to_start_of_next_line(void)
+{
+	do_cursor_down();
+	line_shift = 0;
+	crsr_x = 1;
+	crsr_restore();
+	update_status();
+	return;
+}
+
+
+/* Move the cursor to line 'num', scrolling only if it is off screen */
+static void jump_to_line(int num)
+{
+	struct fold *f;
+	int top, row;
+
+	if (num > line_count) num = line_count;
+	if (num < 1) num = 1;
+	/* A line inside a closed fold is shown by the fold's first line */
+	f = folds_closed ? fold_holding(num, 1) : NULL;
+	if (f != NULL) num = f->start_num;
+	top = line_row(cur_line) - crsr_y + 1;
+	row = line_row(num);
+	cur_line_s = (f != NULL) ? f->start : find_line(num);
+	cur_line = num;
+	if (row >= top && row < top + term_rows) {
+		crsr_y = row - top + 1;
+	} else {
+		/* Off screen: put the line in the middle */
+		crsr_y = (term_rows + 1) / 2;
+		if (crsr_y > row) crsr_y = row;
+	}
+	line_shift = 0;
+	if (crsr_x > cur_line_s->len) crsr_x = cur_line_s->len;
+	if (crsr_x < 1) crsr_x = 1;
+	redraw_screen(0, 0);
+	return;
+}
+
+
+/* Move to line 'num' to edit a range starting there
+ * jump_to_line() stops on the first line of a closed fold, so a fold
+ * holding 'num' is opened first and cur_line_s really is line 'num'. */
+static void jump_to_edit(int num)
+{
+	if (folds_closed) fold_open_line(num);
+	jump_to_line(num);
+	return;
+}
+
+
+/* Put the cursor on column 'col' of the current line */
+static void crsr_to_col(int col)
+{
+	if (col > cur_line_s->len) col = cur_line_s->len;
+	if (col < 1) col = 1;
+	if (col > term_cols) {
+		line_shift = col - term_cols;
+		crsr_x = term_cols;
+	} else {
+		line_shift = 0;
+		crsr_x = col;
+	}
+	redraw_line(cur_line_s, crsr_y);
+	return;
+}
+
+
+/* Put the cursor at offset 'pos' of the current line; unlike
+ * crsr_to_col() this may be just past the end, as insert mode needs */
+static void crsr_to_pos(int pos)
+{
+	if (pos < line_shift || pos - line_shift >= term_cols) {
+		line_shift = (pos >= term_cols) ? pos - term_cols + 1 : 0;
+		redraw_line(cur_line_s, crsr_y);
+	}
+	crsr_x = pos - line_shift + 1;
+	return;
+}
+
+
+/* Line number of a node, or 0 if it isn't in the buffer
+ * There is no line index, so this walks out from the cursor both ways at
+ * once: a position near the cursor resolves quickly in any size file. */
+static int line_number(const struct line *target)
+{
+	struct line *up = cur_line_s, *down = cur_line_s;
+	int n = 0;
+
+	if (target == NULL) return 0;
+	while (up != NULL || down != NULL) {
+		if (up == target) return cur_line - n;
+		if (down == target) return cur_line + n;
+		if (up != NULL) up = up->prev;
+		if (down != NULL) down = down->next;
+		n++;
+	}
+	return 0;
+}
+
+
+/* Point a mark at the cursor position */
+static void mark_here(struct mark *m)
+{
+	m->line = cur_line_s;
+	m->col = crsr_x + line_shift - 1;
+	cur_line_s->flags |= LINE_MARKED;
+	marks_used = 1;
+	return;
+}
+
+
+/* Move to a mark: its exact column, or else the line's first non-blank
+ * Returns 1 if the mark is unset or its line has been deleted. */
+static int mark_goto(const struct mark *m, int exact)
+{
+	int num, col;
+
+	num = line_number(m->line);
+	if (num == 0) {
+		strcpy(custom_status, m->line ? "Mark line was deleted" : "Mark not set");
+		return 1;
+	}
+	jump_to_line(num);
+	if (exact) col = m->col;
+	else for (col = 0; col < cur_line_s->len && word_class(cur_line_s->text[col], 1) == 0; col++);
+	crsr_to_col(col + 1);
+	return 0;
+}
+
+
+/* Remember the cursor position before a jump, for '' and Ctrl-O
+ * A new jump drops any positions Ctrl-O had gone back past. */
+static void jump_push(void)
+{
+	mark_here(&mark_prev);
+	if (jump_pos >= JUMP_MAX) {
+		memmove(jump_list, jump_list + 1, (JUMP_MAX - 1) * sizeof(struct mark));
+		jump_pos = JUMP_MAX - 1;
+	}
+	mark_here(&jump_list[jump_pos++]);
+	jump_len = jump_pos;
+	return;
+}
+
+
+/* Ctrl-O (dir < 0) and Ctrl-I (dir > 0): go back or forward through
+ * the jump list, skipping positions whose lines are gone */
+static void jump_older(int dir, int count)
+{
+	int pos = jump_pos;
+
+	if (dir < 0 && jump_pos == jump_len) {
+		/* Save where we are so Ctrl-I can come back */
+		jump_push();
+		pos = jump_pos = jump_len - 1;
+	}
+	while (count > 0) {
+		pos += dir;
+		if (pos < 0 || pos >= jump_len) {
+			strcpy(custom_status, dir < 0 ? "At start of jump list" : "At end of jump list");
+			return;
+		}
+		if (line_number(jump_list[pos].line) != 0) count--;
+	}
+	jump_pos = pos;
+	mark_goto(&jump_list[pos], 1);
+	return;
+}
+
+
+/* Make a detached copy of a line */
+static struct line *line_dup(const struct line *src)
+{
+	struct line *new_line;
+
+	new_line = (struct line *)vi_malloc(MEM_NODE, sizeof(struct line));
+	if (!new_line) oom();
+	new_line->prev = NULL;
+	new_line->next = NULL;
+	new_line->len = src->len;
+	new_line->alloc_size = (((src->len + 1) >> 5) + 1) << 5;
+	new_line->text = (char *)vi_malloc(MEM_TEXT, new_line->alloc_size);
+	if (!new_line->text) oom();
+	memcpy(new_line->text, src->text, src->len);
+	new_line->text[src->len] = '\0';
+	new_line->text_epoch = buf_epoch;
+	new_line->flags = 0;
+	return new_line;
+}
+
+
+/* Detach 'count' lines starting at line 'start' from the buffer */
+static struct line *lines_unlink(int start, int count)
+{
+	struct line *first, *last;
+	int i;
+
+	if (count <= 0) return NULL;
+	first = find_line(start);
+	if (!first) return NULL;
+	last = first;
+	for (i = 1; i < count && last->next != NULL; i++) last = last->next;
+	if (first->prev != NULL) first->prev->next = last->next;
+	else line_head = last->next;
+	if (last->next != NULL) last->next->prev = first->prev;
+	first->prev = NULL;
+	last->next = NULL;
+	line_count -= i;
+	fold_lines_removed(start, i, first);
+	return first;
+}
+
+
+/* Link a detached list of lines in after 'prev', which is line number
+ * 'prev_num' (NULL and 0 for the top) */
+static void lines_link(struct line *prev, int prev_num, struct line *lines)
+{
+	struct line *last;
+	int count = 1;
+
+	if (lines == NULL) return;
+	for (last = lines; last->next != NULL; last = last->next) count++;
+	if (prev != NULL) {
+		last->next = prev->next;
+		if (prev->next != NULL) prev->next->prev = last;
+		prev->next = lines;
+		lines->prev = prev;
+	} else {
+		last->next = line_head;
+		if (line_head != NULL) line_head->prev = last;
+		line_head = lines;
+		lines->prev = NULL;
+	}
+	line_count += count;
+	fold_lines_added(prev_num, count, lines);
+	return;
+}
+
+
+/* Start recording a change to 'count' lines starting at 'start' */
+static void undo_begin(int start, int count)
+{
+	struct undo_rec *rec;
+	struct line *line, *copy, *tail = NULL;
+
+	if (undo_depth++ > 0) return;
+	/* Edits show what they change */
+	if (folds_closed) fold_open_cursor();
+	rec = (struct undo_rec *)vi_malloc(MEM_UNDO, sizeof(struct undo_rec));
+	if (!rec) oom();
+	rec->lines = NULL;
+	rec->start = start;
+	rec->old_count = 0;
+	rec->col = crsr_x + line_shift;
+	line = find_line(start);
+	while (line != NULL && rec->old_count < count) {
+		copy = line_dup(line);
+		if (tail == NULL) rec->lines = copy;
+		else {
+			tail->next = copy;
+			copy->prev = tail;
+		}
+		tail = copy;
+		rec->old_count++;
+		line = line->next;
+	}
+	undo_line_count = line_count;
+	undo_open = rec;
+	return;
+}
+
+
+/* Widen the open undo record back to line 'start'
+ * For changes that turn out to reach above where they began, like a
+ * backspace that joins onto the previous line. */
+static void undo_extend(int start)
+{
+	struct undo_rec *rec = undo_open;
+	struct line *line, *copy, *first = NULL, *tail = NULL;
+	int n;
+
+	if (rec == NULL || start >= rec->start) return;
+	line = find_line(start);
+	for (n = rec->start - start; n > 0 && line != NULL; n--) {
+		copy = line_dup(line);
+		if (tail == NULL) first = copy;
+		else {
+			tail->next = copy;
+			copy->prev = tail;
+		}
+		tail = copy;
+		line = line->next;
+	}
+	if (tail == NULL) return;
+	tail->next = rec->lines;
+	if (rec->lines != NULL) rec->lines->prev = tail;
+	rec->lines = first;
+	rec->old_count += rec->start - start;
+	rec->start = start;
+	return;
+}
+
+
+/* Free a list of undo records */
+static void undo_free_list(struct undo_rec **list)
+{
+	struct undo_rec *rec;
+
+	while (*list != NULL) {
+		rec = *list;
+		*list = rec->next;
+		destroy_buffer(&rec->lines);
+		vi_free(MEM_UNDO, rec, sizeof(struct undo_rec));
+	}
+	return;
+}
+
+
+/* Finish recording the current change */
+static void undo_end(void)
+{
+	struct undo_rec *rec;
+
+	if (undo_depth == 0) return;
+	if (--undo_depth > 0) return;
+	rec = undo_open;
+	undo_open = NULL;
+	rec->new_count = rec->old_count + line_count - undo_line_count;
+	rec->next = undo_list;
+	undo_list = rec;
+	undo_free_list(&redo_list);
+	return;
+}
+
+
+/* Swap a record's saved lines with the lines now in the buffer */
+static void undo_apply(struct undo_rec *rec)
+{
+	struct line *removed, *prev, *a, *b;
+	int i, count, top;
+
+	top = line_row(cur_line) - crsr_y;
+	prev = find_line(rec->start - 1);
+	/* Marks and folds stay on the lines that take the place of theirs */
+	if (marks_used || fold_count) {
+		a = (prev != NULL) ? prev->next : line_head;
+		for (i = 0, b = rec->lines; i < rec->new_count && a != NULL && b != NULL;
+				i++, a = a->next, b = b->next) {
+			if (a->flags & LINE_MARKED) marks_move(a, b);
+			if (a->flags & LINE_FOLD) fold_move(a, b);
+		}
+	}
+	removed = lines_unlink(rec->start, rec->new_count);
+	lines_link(prev, rec->start - 1, rec->lines);
+	rec->lines = removed;
+	/* Re-anchor the cursor next to the change so lookups stay cheap */
+	if (prev != NULL) {
+		cur_line_s = prev;
+		cur_line = rec->start - 1;
+	} else {
+		cur_line_s = line_head;
+		cur_line = 1;
+	}
+	crsr_y = line_row(cur_line) - top;
+	count = rec->new_count;
+	rec->new_count = rec->old_count;
+	rec->old_count = count;
+	/* The buffer always has at least one line */
+	if (line_head == NULL) alloc_new_line(0, NULL, &line_count, &line_head);
+	jump_to_line(rec->start);
+	crsr_to_col(rec->col);
+	return;
+}
+
+
+/* Undo (redo = 0) or redo (redo = 1) the most recent change */
+static int undo(int redo)
+{
+	struct undo_rec *rec;
+	struct undo_rec **from = redo ? &redo_list : &undo_list;
+	struct undo_rec **to = redo ? &undo_list : &redo_list;
+
+	rec = *from;
+	if (rec == NULL) return 1;
+	TRACE_BEGIN("undo");
+	*from = rec->next;
+	undo_apply(rec);
+	rec->next = *to;
+	*to = rec;
+	TRACE_END("undo");
+	return 0;
+}
+
+
+/* Record a change for lines the caller has already unlinked
+ * The detached lines become the saved copy, so nothing is copied. */
+static void undo_take(int start, struct line *lines, int old_count, int new_count)
+{
+	struct undo_rec *rec;
+
+	/* An enclosing record already has its own copy */
+	if (undo_depth > 0) {
+		destroy_buffer(&lines);
+		return;
+	}
+	rec = (struct undo_rec *)vi_malloc(MEM_UNDO, sizeof(struct undo_rec));
+	if (!rec) oom();
+	rec->lines = lines;
+	rec->start = start;
+	rec->old_count = old_count;
+	rec->new_count = new_count;
+	rec->col = crsr_x + line_shift;
+	rec->next = undo_list;
+	undo_list = rec;
+	undo_free_list(&redo_list);
+	return;
+}
+
+
+/* Restore terminal to original configuration */
+static void term_restore(void)
+{
+	if (termdesc != -1) tcsetattr(termdesc, TCSANOW, &term_orig);
+	render_suppressed = 0;
+	ENABLE_LINE_WRAP();
+	term_flush();
+	return;
+}
+
+/* Initialize terminal settings */
+static int term_init(void)
+{
+	/* Only init terminal once */
+	if (termdesc != -1) return 0;
+
+	/* Find a std* stream with a TTY */
+	if (isatty(STDIN_FILENO)) termdesc = STDIN_FILENO;
+	else if (isatty(STDOUT_FILENO)) termdesc = STDOUT_FILENO;
+	else if (isatty(STDERR_FILENO)) termdesc = STDERR_FILENO;
+	else return -ENOTTY;
+
+	/* Get current terminal configuration and save it*/
+	if (tcgetattr(termdesc, &term_orig)) return -EBADF;
+	memcpy(&term_config, &term_orig, sizeof(struct termios));
+
+	/* Disable buffering */
+	if (isatty(STDIN_FILENO)) setvbuf(stdin, NULL, _IONBF, 0);
+	if (isatty(STDOUT_FILENO)) setvbuf(stdout, NULL, _IONBF, 0);
+	if (isatty(STDERR_FILENO)) setvbuf(stderr, NULL, _IONBF, 0);
+
+	/* Configure terminal settings */
+
+	/* c_cc */
+	term_config.c_cc[VTIME] = 0;
+	term_config.c_cc[VMIN] = 1;	/* read() one char at a time*/
+
+	/* iflag */
+#ifdef IUCLC
+	term_config.c_iflag &= ~IUCLC;
+#endif
+	term_config.c_iflag &= ~PARMRK;
+	term_config.c_iflag |= IGNPAR;
+	term_config.c_iflag &= ~IGNBRK;
+	term_config.c_iflag |= BRKINT;
+	term_config.c_iflag &= ~ISTRIP;
+	term_config.c_iflag &= ~(INLCR | IGNCR | ICRNL);
+
+	/* cflag */
+	term_config.c_cflag &= ~CSIZE;
+	term_config.c_cflag |= CS8;
+	term_config.c_cflag |= CREAD;
+
+	/* lflag */
+	term_config.c_lflag |= ISIG;
+	term_config.c_lflag &= ~ICANON;	/* disable line buffering */
+	term_config.c_lflag &= ~IEXTEN;
+
+	/* disable local echo */
+	term_config.c_lflag &= ~(ECHO | ECHONL | ECHOE | ECHOK);
+
+	/* Finalize settings */
+	tcsetattr(termdesc, TCSANOW, &term_config);
+
+	/* Disable automatic line wrapping */
+	DISABLE_LINE_WRAP();
+
+	set_scroll_area();
+
+	return 0;
+}
+
+/* Clean abort */
+static void clean_abort(void)
+{
+	term_restore();
+	session_close();
+#ifdef VI_TRACE
+	trace_dump();
+#endif	/* VI_TRACE */
+	pool_shutdown();
+	destroy_buffer(&line_head);
+	destroy_buffer(&yank_head);
+	exit(EXIT_FAILURE);
+}
+
+
+/* Monotonic microsecond clock for latency (wraps harmlessly) */
+static unsigned long now_usec(void)
+{
+#ifdef __ELKS__
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif	/* __ELKS__ */
+}
+
+
+/* Monotonic millisecond clock for pacing */
+static unsigned long now_msec(void)
+{
+#ifdef __ELKS__
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif	/* __ELKS__ */
+}
+
+
+/* Note a terminal event in the session being recorded */
+static void session_event(char type, int a, int b)
+{
+	unsigned long now;
+
+	if (session_rec == NULL) return;
+	now = now_usec();
+	if (type == 'r') fprintf(session_rec, "r %lu %d %d\n", now - session_last, a, b);
+	else fprintf(session_rec, "%c %lu %d\n", type, now - session_last, a);
+	session_last = now;
+	return;
+}
+
+
+/* Read the next event of the session being replayed */
+static void session_advance(void)
+{
+	session_next.b = 0;
+	if (fscanf(session_play, " %c %lu %d", &session_next.type,
+				&session_next.usec, &session_next.a) != 3
+			|| (session_next.type == 'r' && fscanf(session_play,
+				" %d", &session_next.b) != 1))
+		session_next.type = 0;
+	return;
+}
+
+
+/* Start replaying VI_REPLAY if it is set; returns nonzero on error */
+static int session_replay_open(void)
+{
+	const char *path = getenv("VI_REPLAY");
+	int version;
+
+	if (path == NULL || *path == '\0') return 0;
+	session_play = fopen(path, "r");
+	if (session_play == NULL) return -1;
+	if (fscanf(session_play, "vee-eye session %d %d %d", &version,
+				&session_rows, &session_cols) != 3 || version != 1)
+		return -2;
+	session_advance();
+	return 0;
+}
+
+
+/* Start recording to VI_RECORD if it is set (and not replaying) */
+static void session_record_open(void)
+{
+	const char *path = getenv("VI_RECORD");
+
+	if (path == NULL || *path == '\0' || session_play != NULL) return;
+	session_rec = fopen(path, "w");
+	if (session_rec == NULL) {
+		snprintf(custom_status, MAX_STATUS, "Cannot record to %s", path);
+		return;
+	}
+	fprintf(session_rec, "vee-eye session 1 %d %d\n", term_real_rows, term_cols);
+	session_last = now_usec();
+	return;
+}
+
+
+static void session_close(void)
+{
+	if (session_rec != NULL) fclose(session_rec);
+	if (session_play != NULL) fclose(session_play);
+	session_rec = NULL;
+	session_play = NULL;
+	return;
+}
+
+
+/* The next replayed key, after any resizes before it; 0 at the end */
+static int session_replay_key(char *c)
+{
+	while (session_next.type == 'r') {
+		session_rows = session_next.a;
+		session_cols = session_next.b;
+		session_advance();
+		handle_resize();
+		term_flush();
+	}
+	if (session_next.type == 0) return 0;
+	*c = (char)session_next.a;
+	session_advance();
+	return 1;
+}
+
+
+/* Add a key typed by the user to the macro being recorded */
+static void record_key(char c)
+{
+	char *new_buf;
+	int new_alloc;
+
+	if (record_len == record_alloc) {
+		new_alloc = record_alloc ? record_alloc << 1 : 64;
+		new_buf = (char *)vi_realloc(MEM_MACRO, record_buf, record_alloc, new_alloc);
+		if (!new_buf) oom();
+		record_buf = new_buf;
+		record_alloc = new_alloc;
+	}
+	record_buf[record_len++] = c;
+	return;
+}
+
+
+/* Read one key; returns 0 at end of input
+ * Keys come from an expanded mapping, a macro being replayed, then
+ * typeahead, then the terminal. Pending output is flushed only when we are about to wait
+ * for the user, and a finished replay gets its single repaint here. */
+static int read_key(char *c)
+{
+	ssize_t got;
+
+	/* Keys produced by a mapping come first, unmapped */
+	if (map_pending_start < MAP_MAX_PENDING) {
+		*c = map_pending[map_pending_start++];
+		return 1;
+	}
+
+	while (replay_depth > 0) {
+		if (key_interrupt) {
+			replay_depth = 0;
+			strcpy(custom_status, "Macro interrupted");
+			break;
+		}
+		if (replay[replay_depth - 1].pos < replay[replay_depth - 1].len) {
+			*c = replay[replay_depth - 1].keys[replay[replay_depth - 1].pos++];
+			return 1;
+		}
+		if (--replay[replay_depth - 1].count > 0) {
+			replay[replay_depth - 1].pos = 0;
+			continue;
+		}
+		replay_depth--;
+	}
+	if (render_suppressed) {
+		render_suppressed = 0;
+		redraw_screen(0, 0);
+		update_status();
+	}
+
+	if (typeahead_len > 0) {
+		*c = typeahead[0];
+		typeahead_len--;
+		memmove(typeahead, typeahead + 1, typeahead_len);
+	} else {
+		term_flush();
+		latency_frame_done();
+		/* Retry reads interrupted by SIGWINCH and friends */
+		while (session_play == NULL) {
+			got = read(STDIN_FILENO, c, 1);
+			STAT_ADD(reads, 1);
+			if (got == 1) break;
+			if (got < 0 && errno == EINTR) {
+				if (winch_pending) {
+					handle_resize();
+					term_flush();
+				}
+				continue;
+			}
+			return 0;
+		}
+		if (session_play != NULL && !session_replay_key(c)) return 0;
+		session_event('k', (unsigned char)*c, 0);
+		latency_key();
+	}
+	STAT_ADD(keys, 1);
+	if (macro_recording >= 0) record_key(*c);
+	return 1;
+}
+
+
+/* Start or stop recording keys into a macro register */
+static void macro_record(char reg)
+{
+	char *keys;
+
+	if (macro_recording >= 0) {
+		/* Drop the 'q' that ended the recording */
+		if (record_len > 0) record_len--;
+		keys = (char *)vi_malloc(MEM_MACRO, record_len + 1);
+		if (!keys) oom();
+		memcpy(keys, record_buf, record_len);
+		vi_free(MEM_MACRO, macro_reg[macro_recording], macro_len[macro_recording] + 1);
+		macro_reg[macro_recording] = keys;
+		macro_len[macro_recording] = record_len;
+		macro_recording = -1;
+		return;
+	}
+	if (reg < 'a' || reg > 'z') {
+		strcpy(custom_status, "Invalid register");
+		return;
+	}
+	if (replay_depth > 0) return;
+	record_len = 0;
+	macro_recording = reg - 'a';
+	return;
+}
+
+
+/* Replay a macro register 'count' times without drawing anything */
+static void macro_play(char reg, long count)
+{
+	int r;
+
+	if (reg == '@') r = macro_last;
+	else if (reg >= 'a' && reg <= 'z') r = reg - 'a';
+	else r = -1;
+	if (r < 0 || macro_reg[r] == NULL || macro_len[r] == 0) {
+		strcpy(custom_status, "Register is empty");
+		return;
+	}
+	if (macro_recording == r) {
+		strcpy(custom_status, "Register is being recorded");
+		return;
+	}
+	if (replay_depth == MACRO_DEPTH) {
+		strcpy(custom_status, "Macros nested too deeply");
+		replay_depth = 0;
+		return;
+	}
+	if (replay_depth == 0) key_interrupt = 0;
+	macro_last = r;
+	replay[replay_depth].keys = macro_reg[r];
+	replay[replay_depth].len = macro_len[r];
+	replay[replay_depth].pos = 0;
+	replay[replay_depth].count = count;
+	replay_depth++;
+	render_suppressed = 1;
+	return;
+}
+
+
+/* Is a key ready within 'msec' milliseconds? */
+static int key_ready(int msec)
+{
+#ifndef __ELKS__
+	struct pollfd pfd;
+#endif	/* __ELKS__ */
+
+	if (replay_depth > 0 || typeahead_len > 0) return 1;
+	/* A replay goes by the recorded gap before the next key */
+	if (session_play != NULL) {
+		term_flush();
+		latency_frame_done();
+		return session_next.type != 0 && session_next.usec <= (unsigned long)msec * 1000;
+	}
+#ifndef __ELKS__
+	term_flush();
+	latency_frame_done();
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, msec) < 0) if (errno != EINTR) return 1;
+	return (pfd.revents & POLLIN) ? 1 : 0;
+#else
+	return 1;
+#endif	/* __ELKS__ */
+}
+
+
+/* Push keys back in front of the pending mapped input */
+static int map_unread(const char *keys, int len, int noremap)
+{
+	if (len > map_pending_start) return -1;
+	map_pending_start -= len;
+	memcpy(map_pending + map_pending_start, keys, len);
+	memset(map_pending_noremap + map_pending_start, noremap, len);
+	return 0;
+}
+
+
+/* Read a key with the mappings for 'mode' applied
+ * The longest mapping that matches wins; if the user stops typing for
+ * map_timeout msec in the middle of a sequence, whatever matched so far
+ * is used. Mappings that keep expanding into themselves are cut off
+ * after MAP_MAX_EXPAND expansions. */
+static int read_mapped_key(char *c, int mode)
+{
+	struct map_node *node, *match;
+	char seq[MAX_CMDSIZE];
+	char noremap;
+	int len, match_len, expansions = 0;
+
+	while (1) {
+		if (map_pending_start < MAP_MAX_PENDING) {
+			*c = map_pending[map_pending_start];
+			noremap = map_pending_noremap[map_pending_start];
+			map_pending_start++;
+		} else {
+			if (!read_key(c)) return 0;
+			noremap = 0;
+		}
+
+		/* Fast path: no mapping starts with this key */
+		if (mode == MAP_NONE || noremap
+				|| map_root[mode][(unsigned char)*c] == NULL) return 1;
+
+		/* Follow the trie as far as the input goes */
+		node = map_root[mode][(unsigned char)*c];
+		seq[0] = *c;
+		len = 1;
+		match = node->rhs ? node : NULL;
+		match_len = match ? 1 : 0;
+		while (node->child != NULL && len < MAX_CMDSIZE) {
+			if (map_pending_start < MAP_MAX_PENDING) {
+				if (map_pending_noremap[map_pending_start]) break;
+				seq[len] = map_pending[map_pending_start++];
+			} else {
+				if (!key_ready(map_timeout) || !read_key(&seq[len])) break;
+			}
+			for (node = node->child; node != NULL; node = node->next)
+				if (node->key == seq[len]) break;
+			len++;
+			if (node == NULL) break;
+			if (node->rhs) {
+				match = node;
+				match_len = len;
+			}
+		}
+
+		if (match == NULL) {
+			/* Not a mapping after all: hand the keys back unmapped */
+			map_unread(seq + 1, len - 1, 0);
+			return 1;
+		}
+		if (++expansions > MAP_MAX_EXPAND
+				|| map_unread(seq + match_len, len - match_len, 0)
+				|| map_unread(match->rhs, match->rhs_len, match->noremap)) {
+			map_pending_start = MAP_MAX_PENDING;
+			strcpy(custom_status, "Recursive mapping");
+		}
+	}
+}
+
+
+/* Turn <CR>, <Esc>, <C-x> etc. in a mapping into the keys they name */
+static int map_parse_keys(const char *src, char *dest)
+{
+	static const struct {
+		const char *name;
+		char key;
+	} names[] = {
+		{ "<cr>", '\r' }, { "<enter>", '\r' }, { "<esc>", '\033' },
+		{ "<space>", ' ' }, { "<tab>", '\t' }, { "<bs>", 0x7f },
+		{ "<lt>", '<' }, { "<bar>", '|' }, { NULL, 0 }
+	};
+	const char *end;
+	int len = 0, i, n;
+
+	while (*src != '\0' && len < MAX_CMDSIZE - 1) {
+		if (*src == '<' && (end = strchr(src, '>')) != NULL) {
+			n = end - src + 1;
+			for (i = 0; names[i].name != NULL; i++) {
+				if ((int)strlen(names[i].name) == n
+						&& strncasecmp(src, names[i].name, n) == 0) break;
+			}
+			if (names[i].name != NULL) {
+				dest[len++] = names[i].key;
+				src += n;
+				continue;
+			}
+			if (n == 5 && (src[1] == 'C' || src[1] == 'c') && src[2] == '-') {
+				dest[len++] = src[3] & 0x1f;
+				src += n;
+				continue;
+			}
+		}
+		dest[len++] = *src++;
+	}
+	return len;
+}
+
+
+/* Add or replace a mapping */
+static void map_add(int mode, const char *lhs, int lhs_len,
+		const char *rhs, int rhs_len, int noremap)
+{
+	struct map_node **slot, *node = NULL;
+	int i;
+
+	slot = &map_root[mode][(unsigned char)lhs[0]];
+	for (i = 0; i < lhs_len; i++) {
+		for (node = *slot; node != NULL; node = node->next)
+			if (node->key == lhs[i]) break;
+		if (node == NULL) {
+			node = (struct map_node *)vi_calloc(MEM_MAP, 1, sizeof(struct map_node));
+			if (!node) oom();
+			node->key = lhs[i];
+			node->next = *slot;
+			*slot = node;
+		}
+		slot = &node->child;
+	}
+	if (node->rhs == NULL) map_count++;
+	vi_free(MEM_MAP, node->rhs, node->rhs_len);
+	node->rhs = (char *)vi_malloc(MEM_MAP, rhs_len);
+	if (!node->rhs) oom();
+	memcpy(node->rhs, rhs, rhs_len);
+	node->rhs_len = rhs_len;
+	node->noremap = (char)noremap;
+	return;
+}
+
+
+/* Remove a mapping and prune trie nodes nothing needs any more */
+static int map_remove(struct map_node **slot, const char *lhs, int lhs_len)
+{
+	struct map_node *node;
+	int found;
+
+	for (; *slot != NULL; slot = &(*slot)->next)
+		if ((*slot)->key == *lhs) break;
+	node = *slot;
+	if (node == NULL) return 0;
+	if (lhs_len == 1) {
+		if (node->rhs == NULL) return 0;
+		vi_free(MEM_MAP, node->rhs, node->rhs_len);
+		node->rhs = NULL;
+		map_count--;
+		found = 1;
+	} else found = map_remove(&node->child, lhs + 1, lhs_len - 1);
+	if (node->rhs == NULL && node->child == NULL) {
+		*slot = node->next;
+		vi_free(MEM_MAP, node, sizeof(struct map_node));
+	}
+	return found;
+}
+
+
+/* :map, :noremap, :imap, :inoremap, :unmap, :iunmap; returns -1 on error */
+static int ex_map(char *args, int mode, int noremap, int unmap)
+{
+	char lhs[MAX_CMDSIZE], rhs[MAX_CMDSIZE];
+	char *sep;
+	int lhs_len, rhs_len;
+
+	while (*args == ' ') args++;
+	if (*args == '\0') {
+		snprintf(custom_status, MAX_STATUS, "%d mappings", map_count);
+		return 0;
+	}
+	sep = strchr(args, ' ');
+	if (sep != NULL) *sep++ = '\0';
+	lhs_len = map_parse_keys(args, lhs);
+	if (unmap) {
+		if (!map_remove(&map_root[mode][(unsigned char)lhs[0]], lhs, lhs_len)) {
+			strcpy(custom_status, "No such mapping");
+			return -1;
+		}
+		return 0;
+	}
+	while (sep != NULL && *sep == ' ') sep++;
+	if (sep == NULL || *sep == '\0') {
+		strcpy(custom_status, "Usage: map lhs rhs");
+		return -1;
+	}
+	rhs_len = map_parse_keys(sep, rhs);
+	map_add(mode, lhs, lhs_len, rhs, rhs_len, noremap);
+	return 0;
+}
+
+
+/* Run a mapping command if that is what 'command' is; returns 0 if it
+ * isn't one, 1 if it ran and -1 if it failed */
+static int ex_map_command(char *command)
+{
+	static const struct {
+		const char *name;
+		int mode;
+		int noremap;
+		int unmap;
+	} cmds[] = {
+		{ "map", MAP_NORMAL, 0, 0 },
+		{ "nmap", MAP_NORMAL, 0, 0 },
+		{ "noremap", MAP_NORMAL, 1, 0 },
+		{ "nnoremap", MAP_NORMAL, 1, 0 },
+		{ "unmap", MAP_NORMAL, 0, 1 },
+		{ "nunmap", MAP_NORMAL, 0, 1 },
+		{ "imap", MAP_INSERT, 0, 0 },
+		{ "inoremap", MAP_INSERT, 1, 0 },
+		{ "iunmap", MAP_INSERT, 0, 1 },
+		{ NULL, 0, 0, 0 }
+	};
+	int i, len;
+
+	for (i = 0; cmds[i].name != NULL; i++) {
+		len = strlen(cmds[i].name);
+		if (strncmp(command, cmds[i].name, len) == 0
+				&& (command[len] == ' ' || command[len] == '\0')) {
+			return ex_map(command + len, cmds[i].mode, cmds[i].noremap,
+					cmds[i].unmap) == 0 ? 1 : -1;
+		}
+	}
+	return 0;
+}
+
+
+/* Options for :set; all of them are numbers */
+static const struct option {
+	const char *name;
+	const char *abbrev;
+	int *value;
+	void (*changed)(void);	/* called after the value changes */
+} options[] = {
+	{ "expandtab", "et", &expand_tab, NULL },
+	{ "shiftwidth", "sw", &shift_width, NULL },
+	{ "timeoutlen", "tm", &map_timeout, NULL },
+	{ "workers", "wk", &pool_workers, pool_shutdown },
+	{ NULL, NULL, NULL, NULL }
+};
+#define OPTION_COUNT ((int)(sizeof(options) / sizeof(struct option)) - 1)
+
+
+static const struct option *find_option(const char *name, int len)
+{
+	const struct option *opt;
+
+	for (opt = options; opt->name != NULL; opt++) {
+		if ((int)strlen(opt->name) == len && strncmp(name, opt->name, len) == 0)
+			return opt;
+		if ((int)strlen(opt->abbrev) == len && strncmp(name, opt->abbrev, len) == 0)
+			return opt;
+	}
+	return NULL;
+}
+
+
+/* :set, :set name?, :set name=value (several may be given)
+ * Returns -1 on an unknown option or bad value. */
+static int ex_set(char *args)
+{
+	const struct option *opt;
+	char *end, *val;
+	int len, n;
+
+	while (*args == ' ') args++;
+	if (*args == '\0') {
+		len = 0;
+		for (opt = options; opt->name != NULL && len < MAX_STATUS; opt++)
+			len += snprintf(custom_status + len, MAX_STATUS - len,
+					"%s%s=%d", len ? " " : "", opt->name, *opt->value);
+		return 0;
+	}
+	while (*args != '\0') {
+		for (end = args; *end != '\0' && *end != ' '; end++);
+		for (val = args; val < end && *val != '=' && *val != '?'; val++);
+		opt = find_option(args, val - args);
+		if (opt == NULL) {
+			snprintf(custom_status, MAX_STATUS, "Unknown option: %.*s",
+					(int)(val - args), args);
+			return -1;
+		}
+		if (val == end || *val == '?') {
+			snprintf(custom_status, MAX_STATUS, "%s=%d", opt->name, *opt->value);
+		} else {
+			n = (int)strtol(val + 1, &val, 10);
+			if (val != end || val == args) {
+				snprintf(custom_status, MAX_STATUS, "Bad value for %s", opt->name);
+				return -1;
+			}
+			if (*opt->value != n) {
+				*opt->value = n;
+				if (opt->changed != NULL) opt->changed();
+			}
+		}
+		for (args = end; *args == ' '; args++);
+	}
+	return 0;
+}
+
+
+/* Run an ex command that is allowed in a startup script; returns 0
+ * if it isn't one, 1 if it ran and -1 if it failed */
+static int ex_setting_command(char *command)
+{
+	if (strncmp(command, "set", 3) == 0 && (command[3] == ' ' || command[3] == '\0'))
+		return ex_set(command + 3) == 0 ? 1 : -1;
+	if (strncmp(command, "se ", 3) == 0)
+		return ex_set(command + 2) == 0 ? 1 : -1;
+	return ex_map_command(command);
+}
+
+
+/* Run a startup script; commands are split by newlines or '|'
+ * Returns the number of commands that failed. */
+static int exrc_run(char *script)
+{
+	char *cmd, *end;
+	int errors = 0;
+	char save;
+
+	for (cmd = script; *cmd != '\0'; cmd = end) {
+		for (end = cmd; *end != '\0' && *end != '\n' && *end != '|'; end++);
+		save = *end;
+		*end = '\0';
+		while (*cmd == ' ' || *cmd == '\t' || *cmd == ':') cmd++;
+		if (end > cmd && end[-1] == '\r') end[-1] = '\0';
+		if (*cmd != '\0' && *cmd != '"' && ex_setting_command(cmd) != 1) errors++;
+		*end = save;
+		if (*end != '\0') end++;
+	}
+	*custom_status = '\0';
+	return errors;
+}
+
+
+#ifndef __ELKS__
+/* Write every mapping under 'node' as a cache record */
+static int exrc_cache_maps(FILE *fp, struct map_node *node, int mode,
+		char *lhs, int depth)
+{
+	struct exrc_cache_rec rec;
+	int count = 0;
+
+	if (depth >= MAX_CMDSIZE) return 0;
+	for (; node != NULL; node = node->next) {
+		lhs[depth] = node->key;
+		if (node->rhs != NULL) {
+			memset(&rec, 0, sizeof(rec));
+			rec.type = EXRC_REC_MAP;
+			rec.mode = (unsigned char)mode;
+			rec.noremap = (unsigned char)node->noremap;
+			rec.lhs_len = (unsigned short)(depth + 1);
+			rec.rhs_len = (unsigned short)node->rhs_len;
+			fwrite(&rec, sizeof(rec), 1, fp);
+			fwrite(lhs, 1, depth + 1, fp);
+			fwrite(node->rhs, 1, node->rhs_len, fp);
+			count++;
+		}
+		count += exrc_cache_maps(fp, node->child, mode, lhs, depth + 1);
+	}
+	return count;
+}
+
+
+/* Save the options that changed from 'defaults' and all mappings */
+static void exrc_cache_write(const char *path, struct exrc_cache_header *hdr,
+		const int *defaults)
+{
+	struct exrc_cache_rec rec;
+	char tmp[PATH_MAX + 8];
+	char lhs[MAX_CMDSIZE];
+	FILE *fp;
+	int i, j;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	fp = fopen(tmp, "wb");
+	if (fp == NULL) return;
+	hdr->record_count = 0;
+	fwrite(hdr, sizeof(*hdr), 1, fp);
+	for (i = 0; i < OPTION_COUNT; i++) {
+		if (*options[i].value == defaults[i]) continue;
+		memset(&rec, 0, sizeof(rec));
+		rec.type = EXRC_REC_OPTION;
+		rec.index = (unsigned char)i;
+		rec.value = *options[i].value;
+		fwrite(&rec, sizeof(rec), 1, fp);
+		hdr->record_count++;
+	}
+	for (i = 0; i < MAP_MODES; i++)
+		for (j = 0; j < 256; j++)
+			hdr->record_count += exrc_cache_maps(fp, map_root[i][j], i, lhs, 0);
+	/* The header goes in last so a partial file never validates */
+	memcpy(hdr->magic, "VIRC", 4);
+	if (fseek(fp, 0, SEEK_SET) != 0 || fwrite(hdr, sizeof(*hdr), 1, fp) != 1
+			|| fclose(fp) != 0 || rename(tmp, path) != 0)
+		unlink(tmp);
+	return;
+}
+
+
+/* Apply a cache whose header matches 'want'; returns 1 on success */
+static int exrc_cache_apply(const char *path, const struct exrc_cache_header *want)
+{
+	const struct exrc_cache_header *hdr;
+	struct exrc_cache_rec rec;
+	const char *base, *p, *end;
+	struct stat st;
+	unsigned int i;
+	int fd, ok = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return 0;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return 0;
+	}
+	base = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == (const char *)MAP_FAILED) return 0;
+	hdr = (const struct exrc_cache_header *)base;
+	end = base + st.st_size;
+	if (memcmp(hdr->magic, "VIRC", 4) != 0
+			|| memcmp((const char *)hdr + 4, (const char *)want + 4,
+				offsetof(struct exrc_cache_header, record_count) - 4) != 0
+			|| hdr->mtime_sec != want->mtime_sec
+			|| hdr->mtime_nsec != want->mtime_nsec
+			|| hdr->size != want->size || hdr->ino != want->ino
+			|| hdr->hash != want->hash) goto done;
+
+	/* Check every record before applying any of them; the name bytes
+	 * after each record leave the next one unaligned, so it is copied */
+	p = base + sizeof(*hdr);
+	for (i = 0; i < hdr->record_count; i++) {
+		if (p + sizeof(rec) > end) goto done;
+		memcpy(&rec, p, sizeof(rec));
+		if (rec.type == EXRC_REC_OPTION) {
+			if (rec.index >= OPTION_COUNT) goto done;
+		} else if (rec.type != EXRC_REC_MAP || rec.mode >= MAP_MODES
+				|| rec.lhs_len == 0) goto done;
+		p += sizeof(rec) + rec.lhs_len + rec.rhs_len;
+		if (p > end) goto done;
+	}
+	p = base + sizeof(*hdr);
+	for (i = 0; i < hdr->record_count; i++) {
+		memcpy(&rec, p, sizeof(rec));
+		p += sizeof(rec);
+		if (rec.type == EXRC_REC_OPTION) {
+			*options[rec.index].value = rec.value;
+		} else {
+			map_add(rec.mode, p, rec.lhs_len, p + rec.lhs_len,
+					rec.rhs_len, rec.noremap);
+		}
+		p += rec.lhs_len + rec.rhs_len;
+	}
+	ok = 1;
+done:
+	munmap((void *)base, st.st_size);
+	return ok;
+}
+#endif	/* __ELKS__ */
+
+
+/* Run EXINIT or else ~/.exrc, using the cached result when it is current
+ * Returns the number of commands that failed. */
+static int exrc_load(void)
+{
+	char path[PATH_MAX], cache[PATH_MAX];
+	const char *exinit, *home;
+	char *script = NULL;
+	size_t script_size;
+	int defaults[OPTION_COUNT + 1];
+	int fd, i, errors;
+	struct stat st;
+#ifndef __ELKS__
+	struct exrc_cache_header hdr;
+	const char *p;
+#endif	/* __ELKS__ */
+
+	exinit = getenv("EXINIT");
+	home = getenv("HOME");
+	if (home == NULL || *home == '\0') home = NULL;
+	else {
+		snprintf(path, PATH_MAX, "%s/.exrc", home);
+		snprintf(cache, PATH_MAX, "%s/" EXRC_CACHE, home);
+	}
+	if (exinit == NULL && home == NULL) return 0;
+
+#ifndef __ELKS__
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, "VIRC", 4);
+	hdr.version = EXRC_CACHE_VERSION;
+	hdr.option_count = OPTION_COUNT;
+	if (exinit != NULL) {
+		/* FNV-1a; EXINIT has no mtime so its text is the key */
+		hdr.hash = 14695981039346656037ULL;
+		for (p = exinit; *p != '\0'; p++)
+			hdr.hash = (hdr.hash ^ (unsigned char)*p) * 1099511628211ULL;
+		hdr.size = p - exinit;
+	} else {
+		if (stat(path, &st) != 0) return 0;
+		hdr.mtime_sec = (unsigned long long)st.st_mtim.tv_sec;
+		hdr.mtime_nsec = (unsigned long long)st.st_mtim.tv_nsec;
+		hdr.size = (unsigned long long)st.st_size;
+		hdr.ino = (unsigned long long)st.st_ino;
+	}
+	if (home != NULL && exrc_cache_apply(cache, &hdr)) return 0;
+#endif	/* __ELKS__ */
+
+	if (exinit != NULL) {
+		script_size = strlen(exinit) + 1;
+		script = (char *)vi_malloc(MEM_MISC, script_size);
+		if (script == NULL) oom();
+		strcpy(script, exinit);
+	} else {
+		fd = open(path, O_RDONLY);
+		if (fd < 0) return 0;
+		if (fstat(fd, &st) != 0) {
+			close(fd);
+			return 1;
+		}
+		script_size = st.st_size + 1;
+		if ((script = (char *)vi_malloc(MEM_MISC, script_size)) == NULL) {
+			close(fd);
+			return 1;
+		}
+		i = read(fd, script, st.st_size);
+		close(fd);
+		if (i < 0) i = 0;
+		script[i] = '\0';
+	}
+	for (i = 0; i < OPTION_COUNT; i++) defaults[i] = *options[i].value;
+	errors = exrc_run(script);
+	vi_free(MEM_MISC, script, script_size);
+#ifndef __ELKS__
+	/* Only cache a clean run so errors are reported every time */
+	if (errors == 0 && home != NULL) exrc_cache_write(cache, &hdr, defaults);
+#endif	/* __ELKS__ */
+	return errors;
+}
+
+
+#ifndef NO_SIGNALS
+/* Ctrl-C cancels long operations instead of killing the editor */
+static void sigint_handler(int signum)
+{
+	op_token.cancelled = 1;
+	key_interrupt = 1;
+	return;
+}
+#endif	/* NO_SIGNALS */
+
+
+/* Start a long-running operation; 'total' is the amount of work or 0 */
+static void op_begin(const char *name, long total)
+{
+	TRACE_BEGIN(name);
+	op_name = name;
+	op_done = 0;
+	op_total = total;
+	op_token.cancelled = 0;
+	op_start = now_msec();
+	op_last_poll = op_start;
+	return;
+}
+
+
+/* A key typed during a long operation: ESC and Ctrl-C cancel it and
+ * anything else waits until it is done. An ESC with more keys within
+ * map_timeout starts an arrow or function key and waits as well.
+ * Returns 1 if it cancelled */
+static int op_key(char c, int followed)
+{
+	if (c == '\003' || (c == '\033' && !followed)) {
+		op_token.cancelled = 1;
+		return 1;
+	}
+	if (typeahead_len < TYPEAHEAD_SIZE) typeahead[typeahead_len++] = c;
+	return 0;
+}
+
+
+/* Check for ESC/Ctrl-C and show progress, at most every OP_POLL_MSEC */
+static void op_poll(void)
+{
+	unsigned long now;
+	long done;
+#ifndef __ELKS__
+	struct pollfd pfd;
+#endif	/* __ELKS__ */
+	char c;
+	int followed;
+
+	if (op_name == NULL) return;
+	/* A replay hands over what was typed during the operation at once */
+	while (session_play != NULL && session_next.type == 'p') {
+		c = (char)session_next.a;
+		session_advance();
+		latency_key();
+		followed = (c == '\033' && session_next.type == 'p'
+				&& session_next.usec <= (unsigned long)map_timeout * 1000);
+		if (op_key(c, followed)) break;
+	}
+	now = now_msec();
+	if (now - op_last_poll < OP_POLL_MSEC) return;
+	op_last_poll = now;
+
+#ifndef __ELKS__
+	/* Keep anything else the user types for after the operation; only
+	 * a real terminal is polled, not a replay or the library */
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+	while (termdesc != -1 && poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+		STAT_ADD(reads, 1);
+		if (read(STDIN_FILENO, &c, 1) != 1) break;
+		session_event('p', (unsigned char)c, 0);
+		latency_key();
+		followed = (c == '\033' && poll(&pfd, 1, map_timeout) > 0
+				&& (pfd.revents & POLLIN));
+		if (op_key(c, followed)) break;
+	}
+#endif	/* __ELKS__ */
+
+	if (now - op_start < OP_SHOW_MSEC) return;
+	done = op_done;
+	if (op_total > 0) snprintf(custom_status, MAX_STATUS, "%s: %ld%% (ESC cancels)",
+			op_name, (long)((done * 100.0) / op_total));
+	else snprintf(custom_status, MAX_STATUS, "%s... (ESC cancels)", op_name);
+	update_status();
+	term_flush();
+	return;
+}
+
+
+/* Report progress; returns nonzero if the operation was cancelled */
+static int op_progress(long done)
+{
+	op_done = done;
+	op_poll();
+	return op_token.cancelled;
+}
+
+
+/* Finish a long-running operation; returns nonzero if it was cancelled */
+static int op_end(void)
+{
+	int cancelled = op_token.cancelled;
+
+	TRACE_END(op_name);
+	op_name = NULL;
+	op_token.cancelled = 0;
+	return cancelled;
+}
+
+
+/* Resize a line's private text; arena text moves to the heap */
+static void line_resize_text(struct line *line, int new_size)
+{
+	char *new_text;
+
+	if (line->flags & LINE_ARENA_TEXT) {
+		new_text = (char *)vi_malloc(MEM_TEXT, new_size);
+		if (!new_text) oom();
+		memcpy(new_text, line->text, line->len + 1);
+		arena_release(line->text, line->alloc_size);
+		line->flags &= ~LINE_ARENA_TEXT;
+	} else {
+		new_text = (char *)vi_realloc(MEM_TEXT, line->text, line->alloc_size, new_size);
+		if (!new_text) oom();
+	}
+	line->text = new_text;
+	line->alloc_size = new_size;
+	return;
+}
+
+
+/* Make sure a line can hold 'len' bytes plus a terminator */
+static void line_reserve(struct line *line, int len)
+{
+	line_cow(line);
+	if (line->alloc_size > len) return;
+	line_resize_text(line, (((len + 1) >> 5) + 1) << 5);
+	return;
+}
+
+
+/* Repaint 'len' cells at the cursor without redrawing the whole line */
+static void paint_cells(const char *text, int len)
+{
+	if (render_suppressed) return;
+	if (len > term_cols - crsr_x + 1) len = term_cols - crsr_x + 1;
+	crsr_restore();
+	if (len > 0) term_write(text, len);
+	return;
+}
+
+
+static void insert_char(char c)
+{
+	char *new_text;
+	char *p;
+	int pos, new_alloc;
+
+	switch (vi_mode) {
+	case 1:	/* insert mode */
+		pos = crsr_x + line_shift - 1;
+		if (pos < change_gap_end) {
+			/* Type over the span being changed */
+			line_cow(cur_line_s);
+			cur_line_s->text[pos] = c;
+			if (crsr_x > term_cols) line_shift_increase(1);
+			else {
+				paint_cells(&c, 1);
+				crsr_x++;
+			}
+			return;
+		}
+		line_cow(cur_line_s);
+		if (cur_line_s->alloc_size <= (cur_line_s->len + 1)) {
+			/* Allocate a larger buffer and insert to that */
+			line_resize_text(cur_line_s, cur_line_s->alloc_size < 16
+					? 32 : cur_line_s->alloc_size << 1);
+		}
+		/* Move text up by one byte */
+		p = cur_line_s->text + crsr_x + line_shift - 1;
+		memmove(p + 1, p, strlen(p) + 1);
+		*p = c;
+		if (crsr_x > term_cols) line_shift_increase(1);
+		else crsr_x++;
+		cur_line_s->len++;
+		if (change_gap_end >= 0) change_gap_end = pos + 1;
+		return;
+
+	case 2: /* replace mode */
+		pos = crsr_x + line_shift - 1;
+		if (pos < cur_line_s->len) {
+			line_cow(cur_line_s);
+			if (replace_saved == replace_save_alloc) {
+				new_alloc = replace_save_alloc ? replace_save_alloc << 1 : 64;
+				new_text = (char *)vi_realloc(MEM_EDIT, replace_save,
+						replace_save_alloc, new_alloc);
+				if (!new_text) oom();
+				replace_save = new_text;
+				replace_save_alloc = new_alloc;
+			}
+			replace_save[replace_saved++] = cur_line_s->text[pos];
+		} else {
+			/* Past the end the line grows instead */
+			line_reserve(cur_line_s, cur_line_s->len + 1);
+			cur_line_s->len++;
+			cur_line_s->text[cur_line_s->len] = '\0';
+		}
+		cur_line_s->text[pos] = c;
+		replace_typed++;
+		if (crsr_x > term_cols) line_shift_increase(1);
+		else {
+			paint_cells(&c, 1);
+			crsr_x++;
+		}
+		return;
+	}
+
+	return;
+}
+
+
+/* Backspace in replace mode: put back what was typed over */
+static void replace_backspace(void)
+{
+	int pos;
+
+	if (crsr_x > 1) crsr_x--;
+	else if (line_shift > 0) line_shift_reduce(1);
+	else return;
+	if (replace_typed == 0) return;
+	pos = crsr_x + line_shift - 1;
+	line_cow(cur_line_s);
+	if (replace_typed > replace_saved) {
+		/* This key grew the line, so shrink it again */
+		cur_line_s->len = pos;
+		cur_line_s->text[pos] = '\0';
+		if (!render_suppressed) {
+			crsr_restore();
+			ERASE_TO_EOL();
+		}
+	} else {
+		cur_line_s->text[pos] = replace_save[--replace_saved];
+		paint_cells(cur_line_s->text + pos, 1);
+	}
+	replace_typed--;
+	return;
+}
+
+
+/* Remember a key typed in insert mode for '.' */
+static void capture_insert(char c)
+{
+	char *new_text;
+	int new_alloc;
+
+	if (!insert_capture) return;
+	if (c == '\b') {
+		if (last_change.text_len > 0) last_change.text_len--;
+		return;
+	}
+	if (last_change.text_len == last_change.text_alloc) {
+		new_alloc = last_change.text_alloc ? last_change.text_alloc << 1 : 64;
+		new_text = (char *)vi_realloc(MEM_EDIT, last_change.text,
+				last_change.text_alloc, new_alloc);
+		if (!new_text) oom();
+		last_change.text = new_text;
+		last_change.text_alloc = new_alloc;
+	}
+	last_change.text[last_change.text_len++] = c;
+	return;
+}
+
+
+/* Insert text (lines separated by '\n') 'count' times at offset 'pos'
+ * of the current line. Each piece of text is copied straight into its final place, so a
+ * line costs one memcpy no matter how much was typed into it. The
+ * cursor ends up on the last inserted character. */
+static void insert_text(const char *text, int len, int count, int pos)
+{
+	struct line *line = cur_line_s;
+	const char *seg, *nl, *end = text + len;
+	char *tail = NULL;
+	int tail_len, seg_len, added = 0;
+
+	if (len <= 0 || count < 1) return;
+	if (pos > line->len) pos = line->len;
+	if (pos < 0) pos = 0;
+
+	/* Set the rest of the line aside until the text is in */
+	tail_len = line->len - pos;
+	if (tail_len > 0) {
+		tail = (char *)vi_malloc(MEM_EDIT, tail_len);
+		if (!tail) oom();
+		memcpy(tail, line->text + pos, tail_len);
+	}
+	line_cow(line);
+	line->len = pos;
+
+	while (count-- > 0) {
+		for (seg = text; seg < end; seg = nl + 1) {
+			nl = (const char *)memchr(seg, '\n', end - seg);
+			if (nl == NULL) nl = end;
+			seg_len = nl - seg;
+			line_reserve(line, line->len + seg_len);
+			memcpy(line->text + line->len, seg, seg_len);
+			line->len += seg_len;
+			line->text[line->len] = '\0';
+			if (nl == end) break;
+			/* Start a new line after this one */
+			line = alloc_new_line(0, NULL, &line_count, &line);
+			if (!line) oom();
+			added++;
+		}
+	}
+
+	pos = line->len;
+	if (tail_len > 0) {
+		line_reserve(line, line->len + tail_len);
+		memcpy(line->text + line->len, tail, tail_len);
+		line->len += tail_len;
+		line->text[line->len] = '\0';
+		vi_free(MEM_EDIT, tail, tail_len);
+	}
+
+	cur_line_s = line;
+	cur_line += added;
+	if (crsr_y + added <= term_rows) crsr_y += added;
+	else crsr_y = term_rows;
+	if (added > 0) redraw_screen(0, 0);
+	crsr_to_col(pos);
+	return;
+}
+
+
+/* Remove what is left of the span a change was typing over */
+static void change_close_gap(void)
+{
+	int pos, gap;
+
+	if (change_gap_end < 0) return;
+	pos = crsr_x + line_shift - 1;
+	gap = change_gap_end - pos;
+	change_gap_end = -1;
+	if (gap <= 0) return;
+	line_cow(cur_line_s);
+	memmove(cur_line_s->text + pos, cur_line_s->text + pos + gap,
+			cur_line_s->len - pos - gap + 1);
+	cur_line_s->len -= gap;
+	redraw_line(cur_line_s, crsr_y);
+	return;
+}
+
+
+/* Editing mode. Doesn't return until ESC pressed. */
+static void edit_mode(void)
+{
+	unsigned char c;
+	char *fragment;
+	int overwrite;
+
+	while (read_mapped_key((char *)&c, MAP_INSERT)) {
+		switch (c) {
+		case '\0':
+			continue;
+
+		case '\b':
+		case 0x7f:
+			if (vi_mode == MODE_REPLACE) {
+				replace_backspace();
+				capture_insert('\b');
+				crsr_restore();
+				continue;
+			}
+			if (change_gap_end >= 0) {
+				/* Backing up just widens the span still to go */
+				if (crsr_x + line_shift - 1 > change_gap_start) {
+					if (crsr_x > 1) crsr_x--;
+					else line_shift_reduce(1);
+					capture_insert('\b');
+					crsr_restore();
+				}
+				continue;
+			}
+			if (crsr_x > 1) {
+				crsr_x--;
+				do_del_under_crsr(1);
+				capture_insert('\b');
+			} else if (line_shift == 0 && cur_line > 1) {
+				/* Join this line onto the end of the one above */
+				undo_extend(cur_line - 1);
+				crsr_to_pos(join_lines(cur_line - 1, 2, 0));
+				capture_insert('\b');
+			}
+			continue;
+
+		case '\n':
+		case '\r':	/* New line */
+			change_close_gap();
+			line_cow(cur_line_s);
+			fragment = cur_line_s->text + line_shift + crsr_x - 1;
+//			sprintf(custom_status, "txt %p, adjtxt %p, ls+cx %d+%d",
+//					cur_line_s->text, fragment, line_shift, crsr_x);
+
+			if (!alloc_new_line(cur_line, fragment, &line_count, &line_head)) oom();
+
+			/* New lines need to break the old line apart */
+			if (*fragment != '\0') {
+				cur_line_s->len = line_shift + crsr_x - 1;
+				*fragment = '\0';
+			}
+			go_to_start_of_next_line();
+			redraw_screen(crsr_y, 0);
+			capture_insert('\n');
+			/* Backspace can't go back past a line break */
+			replace_saved = 0;
+			replace_typed = 0;
+			continue;
+
+		case '\033':
+			/* FIXME: poll for ESC sequences */
+			goto end_edit_mode;
+
+		default:
+			break;
+		}
+
+		/* Catch any invalid characters */
+		if (c < 32 || c > 127) {
+			sprintf(custom_status, "Invalid char entered: %u", c);
+			update_status();
+			continue;
+		}
+		/* Insert character at cursor position */
+		overwrite = (vi_mode == MODE_REPLACE
+				|| crsr_x + line_shift - 1 < change_gap_end);
+		insert_char(c);
+		capture_insert(c);
+		if (!overwrite) redraw_line(cur_line_s, crsr_y);
+		crsr_restore();
+		update_status();
+	}
+
+end_edit_mode:
+	change_close_gap();
+	if (crsr_x > 1) crsr_x--;
+	vi_mode = MODE_COMMAND;
+	update_status();
+	return;
+}
+
+
+/* Get a free-form command string from the user */
+static int get_command_string(char *command)
+{
+	int cmdsize = 0;
+	char cc;
+
+	while (read_key(&cc)) {
+		/* If user presses ESC, abort */
+		if (cc == '\033') {
+			command[0] = '\0';
+			return 0;
+		}
+
+		/* Backspace */
+		if (cc == '\b' || cc == 0x7f) {
+			command[cmdsize] = '\0';
 			cmdsize--;
 			if (cmdsize < 0) return 0;;
-			write(STDOUT_FILENO, "\b \b", 3);
+			term_write("\b \b", 3);
+			continue;
+		}
+
+		/* Newline or carriage return */
+		if (cc == '\n' || cc == '\r') {
+			command[cmdsize] = '\0';
+			break;
+		}
+		term_write(&cc, 1);
+		command[cmdsize] = cc;
+		cmdsize++;
+		if (cmdsize == MAX_CMDSIZE - 1) {
+			command[cmdsize] = '\0';
+			break;
+		}
+	}
+	return cmdsize;
+}
+
+
+static void do_cursor_left(void)
+{
+	if (crsr_x == 1) {
+		if (line_shift > 0) {
+			line_shift_reduce(1);
+			redraw_line(cur_line_s, crsr_y);
+		}
+		return;
+	} else CRSR_LEFT();
+	crsr_x--;
+	return;
+}
+
+static void do_cursor_right(void)
+{
+	if (crsr_x > cur_line_s->len) return;
+	if (crsr_x == term_cols) {
+		if ((cur_line_s->len - line_shift) > term_cols) {
+			line_shift_increase(1);
+			redraw_line(cur_line_s, crsr_y);
+		} else {
+			oh_dear_god_no("cmd: l: term_cols check");
+			return;
+		}
+	} else {
+		/* Only move one space beyond end when in edit mode */
+		if ((crsr_x < (cur_line_s->len - line_shift)) ||
+			(vi_mode > 0 &&
+			crsr_x == (cur_line_s->len - line_shift))) {
+			crsr_x++;
+			CRSR_RIGHT();
+		}
+	}
+	return;
+}
+
+
+static void do_cursor_up(void)
+{
+	struct fold *f;
+	int temp_shift = line_shift;
+
+	line_shift = 0;
+	redraw_line(cur_line_s, crsr_y);
+	line_shift = temp_shift;
+	if (cur_line == 1) return;
+	if (cur_line_s->prev == NULL) return;
+	cur_line_s = cur_line_s->prev;
+	cur_line--;
+	f = fold_closed_at(cur_line_s, 1);
+	if (f != NULL) {
+		cur_line_s = f->start;
+		cur_line = f->start_num;
+	}
+	if (crsr_y > 1) crsr_y--;
+//	else redraw_screen(0, 0);
+	else {
+		SCROLL_UP();
+	}
+	/* Pull the cursor to EOL if it is too far over */
+	if (crsr_x > cur_line_s->len) crsr_x = cur_line_s->len;
+	line_shift = 0;
+	redraw_line(cur_line_s, crsr_y);
+
+	return;
+}
+
+
+static void do_cursor_down(void)
+{
+	struct fold *f;
+	int temp_shift = line_shift;
+
+	line_shift = 0;
+	redraw_line(cur_line_s, crsr_y);
+	line_shift = temp_shift;
+	if (cur_line == line_count) return;
+	if (cur_line_s->next == NULL) return;
+	f = fold_closed_at(cur_line_s, 0);
+	if (f != NULL) {
+		if (f->end->next == NULL) return;
+		cur_line_s = f->end;
+		cur_line = f->end_num;
+	}
+	cur_line_s = cur_line_s->next;
+	cur_line++;
+	if (crsr_y < term_rows) crsr_y++;
+//	else redraw_screen(0, 0);
+	else {
+		SCROLL_DOWN();
+		redraw_line(cur_line_s, crsr_y);
+	}
+	/* Pull the cursor to EOL if it is too far over */
+	if ((crsr_x + line_shift) > cur_line_s->len) {
+		if (cur_line_s->len <= line_shift)
+			line_shift = cur_line_s->len - 1;
+		crsr_x = cur_line_s->len - line_shift;
+		if (crsr_x == 0) crsr_x = 1;
+		//redraw_screen(0, 0);
+		redraw_line(cur_line_s, crsr_y);
+	}
+
+	return;
+}
+
+
+/* Pick the worker count for the thread pool */
+static int pool_thread_count(void)
+{
+#ifdef NO_THREADS
+	pool_workers = 0;
+#else
+	long cpus;
+
+	if (pool_workers < 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		pool_workers = (cpus > 1) ? (int)cpus - 1 : 0;
+	}
+	if (pool_workers > POOL_MAX_WORKERS) pool_workers = POOL_MAX_WORKERS;
+#endif	/* NO_THREADS */
+	return pool_workers;
+}
+
+
+#ifndef NO_THREADS
+/* Take a task from deque 'self', or steal one from another deque */
+static int pool_take(int self, struct pool_task *task)
+{
+	struct pool_deque *dq;
+	int i, victim;
+
+	dq = &pool.deques[self];
+	pthread_mutex_lock(&dq->lock);
+	if (dq->head != dq->tail) {
+		dq->tail--;
+		*task = dq->tasks[dq->tail];
+		pthread_mutex_unlock(&dq->lock);
+		return 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	for (i = 1; i <= pool.started; i++) {
+		victim = (self + i) % (pool.started + 1);
+		dq = &pool.deques[victim];
+		pthread_mutex_lock(&dq->lock);
+		if (dq->head != dq->tail) {
+			*task = dq->tasks[dq->head];
+			dq->head++;
+			pthread_mutex_unlock(&dq->lock);
+			return 1;
+		}
+		pthread_mutex_unlock(&dq->lock);
+	}
+	return 0;
+}
+
+
+/* Run one task unless the job was cancelled, then count it as done */
+static void pool_do_task(struct pool_task *task)
+{
+	if (!pool.cancel || !pool.cancel->cancelled)
+		task->fn(task->arg, task->start, task->end);
+	pthread_mutex_lock(&pool.lock);
+	pool.pending--;
+	if (pool.pending == 0) pthread_cond_signal(&pool.done_cond);
+	pthread_mutex_unlock(&pool.lock);
+	return;
+}
+
+
+static void *pool_worker(void *arg)
+{
+	struct pool_task task;
+	int self = (int)(uintptr_t)arg;
+	int seen = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	while (1) {
+		while (!pool.shutdown && (pool.generation == seen || pool.pending == 0))
+			pthread_cond_wait(&pool.work_cond, &pool.lock);
+		if (pool.shutdown) break;
+		seen = pool.generation;
+		pthread_mutex_unlock(&pool.lock);
+		while (pool_take(self, &task)) pool_do_task(&task);
+		pthread_mutex_lock(&pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+
+/* Start worker threads; falls back to fewer (or zero) on failure */
+static void pool_start(void)
+{
+	int i;
+
+	if (pool.started == 0) {
+		pthread_mutex_init(&pool.lock, NULL);
+		pthread_cond_init(&pool.work_cond, NULL);
+		pthread_cond_init(&pool.done_cond, NULL);
+		for (i = 0; i <= POOL_MAX_WORKERS; i++)
+			pthread_mutex_init(&pool.deques[i].lock, NULL);
+	}
+	while (pool.started < pool_workers) {
+		if (pthread_create(&pool.threads[pool.started], NULL,
+				pool_worker, (void *)(uintptr_t)(pool.started + 1)) != 0) {
+			pool_workers = pool.started;
+			break;
+		}
+		pool.started++;
+	}
+	return;
+}
+#endif	/* NO_THREADS */
+
+
+/* Stop all worker threads */
+static void pool_shutdown(void)
+{
+#ifndef NO_THREADS
+	int i;
+
+	if (pool.started == 0) return;
+	pthread_mutex_lock(&pool.lock);
+	pool.shutdown = 1;
+	pthread_cond_broadcast(&pool.work_cond);
+	pthread_mutex_unlock(&pool.lock);
+	for (i = 0; i < pool.started; i++) pthread_join(pool.threads[i], NULL);
+	pool.started = 0;
+	pool.shutdown = 0;
+#endif	/* NO_THREADS */
+	return;
+}
+
+
+/* Run fn over items [0, count) in tasks of at most 'grain' items
+ * Returns 0 when all work is done or 1 if the token cancelled it. Only
+ * the main thread may call this and it may not be called recursively. */
+static int pool_run(pool_fn fn, void *arg, long count, long grain,
+		struct cancel_token *cancel)
+{
+	long start, ntasks;
+	int threads;
+#ifndef NO_THREADS
+	struct pool_task task;
+	struct pool_deque *dq;
+	struct timespec wait_until;
+	int i;
+#endif	/* NO_THREADS */
+
+	if (count <= 0) return 0;
+	if (grain < 1) grain = 1;
+	if (grain > POOL_MAX_GRAIN) grain = POOL_MAX_GRAIN;
+	threads = pool_thread_count() + 1;
+
+	/* Don't cut the work into more tasks than the deques can hold */
+	ntasks = (count + grain - 1) / grain;
+	if (ntasks > (long)threads * POOL_TASKS_PER_THREAD) {
+		ntasks = (long)threads * POOL_TASKS_PER_THREAD;
+		grain = (count + ntasks - 1) / ntasks;
+	}
+
+#ifndef NO_THREADS
+	if (threads > 1) pool_start();
+	if (pool.started > 0) {
+		/* Deal tasks out round-robin so every thread starts busy */
+		pthread_mutex_lock(&pool.lock);
+		pool.cancel = cancel;
+		pool.pending = 0;
+		for (i = 0; i <= pool.started; i++) {
+			pthread_mutex_lock(&pool.deques[i].lock);
+			pool.deques[i].head = 0;
+			pool.deques[i].tail = 0;
+			pthread_mutex_unlock(&pool.deques[i].lock);
+		}
+		i = 0;
+		for (start = 0; start < count; start += grain) {
+			dq = &pool.deques[i];
+			pthread_mutex_lock(&dq->lock);
+			dq->tasks[dq->tail].fn = fn;
+			dq->tasks[dq->tail].arg = arg;
+			dq->tasks[dq->tail].start = start;
+			dq->tasks[dq->tail].end = (start + grain < count) ? start + grain : count;
+			dq->tail++;
+			pthread_mutex_unlock(&dq->lock);
+			pool.pending++;
+			i = (i + 1) % (pool.started + 1);
+		}
+		pool.generation++;
+		pthread_cond_broadcast(&pool.work_cond);
+		pthread_mutex_unlock(&pool.lock);
+
+		/* Help out, then wait for the stragglers */
+		while (pool_take(0, &task)) {
+			pool_do_task(&task);
+			op_poll();
+		}
+		pthread_mutex_lock(&pool.lock);
+		while (pool.pending > 0) {
+			clock_gettime(CLOCK_REALTIME, &wait_until);
+			wait_until.tv_nsec += OP_POLL_MSEC * 1000000L;
+			if (wait_until.tv_nsec >= 1000000000L) {
+				wait_until.tv_sec++;
+				wait_until.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&pool.done_cond, &pool.lock, &wait_until);
+			pthread_mutex_unlock(&pool.lock);
+			op_poll();
+			pthread_mutex_lock(&pool.lock);
+		}
+		pool.cancel = NULL;
+		pthread_mutex_unlock(&pool.lock);
+		return (cancel && cancel->cancelled) ? 1 : 0;
+	}
+#endif	/* NO_THREADS */
+
+	/* Inline execution */
+	for (start = 0; start < count; start += grain) {
+		if (cancel && cancel->cancelled) return 1;
+		fn(arg, start, (start + grain < count) ? start + grain : count);
+		op_poll();
+	}
+	return (cancel && cancel->cancelled) ? 1 : 0;
+}
+
+
+/* Newline offsets found in one piece of a file being loaded */
+struct load_piece {
+	long *nl;
+	long nl_count;
+	long nl_alloc;
+};
+
+struct load_scan {
+	char *data;
+	long size;
+	long piece_size;
+	struct load_piece *pieces;
+};
+
+/* Pool task: find and terminate every newline in some file pieces */
+static void load_scan_pieces(void *arg, long start, long end)
+{
+	struct load_scan *scan = (struct load_scan *)arg;
+	struct load_piece *piece;
+	char *p, *stop;
+	long *new_nl;
+	long new_alloc;
+
+	for (; start < end; start++) {
+		piece = &scan->pieces[start];
+		p = scan->data + start * scan->piece_size;
+		stop = p + scan->piece_size;
+		if (stop > scan->data + scan->size) stop = scan->data + scan->size;
+		while (p < stop && (p = (char *)memchr(p, '\n', stop - p)) != NULL) {
+			if (piece->nl_count == piece->nl_alloc) {
+				new_alloc = piece->nl_alloc ? piece->nl_alloc << 1 : 256;
+				new_nl = (long *)vi_realloc(MEM_LOAD, piece->nl,
+						piece->nl_alloc * sizeof(long), new_alloc * sizeof(long));
+				/* Give up on this piece; load_file() reports it */
+				if (!new_nl) {
+					piece->nl_count = -1;
+					break;
+				}
+				piece->nl = new_nl;
+				piece->nl_alloc = new_alloc;
+			}
+			*p = '\0';
+			piece->nl[piece->nl_count++] = p - scan->data;
+			p++;
+		}
+	}
+	return;
+}
+
+
+/* Load a file into buffer starting at a particular line
+ * The whole file is read at once; the newline scan is split into
+ * pieces that run on the thread pool, then the lines are linked
+ * into the buffer in file order. */
+static int load_file(const char * const restrict name, const int start_line)
+{
+	struct line *cur_load_line;
+	struct load_scan scan;
+	char *new_data;
+	long alloc, pieces, i, j, line_start;
+	int fd;
+	int load_line_count = 0;
+	int ret = 0;
+	ssize_t got;
+
+	/* start_line = 0 will load at the beginning of the buffer */
+	if ((start_line != 0) && (start_line > line_count)) {
+		return -1;
+	}
+	if (name[0] == '\0') {
+		strcpy(custom_status, "No filename specified to load");
+		return -2;
+	}
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) return -3;
+
+	/* Slurp the whole file, leaving room for a terminator */
+	alloc = CHUNK_SIZE;
+	scan.size = 0;
+	scan.data = (char *)vi_malloc(MEM_LOAD, alloc);
+	if (!scan.data) oom();
+	while (1) {
+		if (scan.size + CHUNK_SIZE + 1 > alloc) {
+			new_data = (char *)vi_realloc(MEM_LOAD, scan.data, alloc, alloc << 1);
+			if (!new_data) oom();
+			scan.data = new_data;
+			alloc <<= 1;
+		}
+		got = read(fd, scan.data + scan.size, alloc - scan.size - 1);
+		if (got == 0) break;
+		if (got < 0) {
+			if (errno == EINTR) continue;
+			close(fd);
+			vi_free(MEM_LOAD, scan.data, alloc);
+			return -4;
+		}
+		scan.size += got;
+	}
+	close(fd);
+	scan.data[scan.size] = '\0';
+
+	/* Find the newlines in parallel */
+	pieces = (long)(pool_thread_count() + 1) * POOL_TASKS_PER_THREAD;
+	scan.piece_size = (scan.size / pieces) + 1;
+	if (scan.piece_size < POOL_MAX_GRAIN) scan.piece_size = POOL_MAX_GRAIN;
+	pieces = (scan.size + scan.piece_size - 1) / scan.piece_size;
+	scan.pieces = (struct load_piece *)vi_calloc(MEM_LOAD, pieces + 1, sizeof(struct load_piece));
+	if (!scan.pieces) oom();
+	pool_run(load_scan_pieces, &scan, pieces, 1, NULL);
+
+	cur_load_line = walk_to_line(start_line, line_head);
+	if (cur_load_line == NULL) cur_load_line = line_head;
+	line_start = 0;
+	for (i = 0; i < pieces; i++) {
+		if (scan.pieces[i].nl_count < 0) oom();
+		for (j = 0; j < scan.pieces[i].nl_count; j++) {
+			cur_load_line = alloc_new_line(0, scan.data + line_start,
+					&line_count, &cur_load_line);
+			if (cur_load_line == NULL) {
+				ret = -5;
+				goto load_done;
+			}
+			if (line_head == NULL) {
+				line_head = cur_load_line;
+				line_head->prev = NULL;
+			}
+			load_line_count++;
+			line_start = scan.pieces[i].nl[j] + 1;
+		}
+	}
+	/* Last line without a trailing newline */
+	if (line_start < scan.size) {
+		cur_load_line = alloc_new_line(0, scan.data + line_start,
+				&line_count, &cur_load_line);
+		if (cur_load_line == NULL) {
+			ret = -5;
+			goto load_done;
+		}
+		if (line_head == NULL) {
+			line_head = cur_load_line;
+			line_head->prev = NULL;
+		}
+		load_line_count++;
+	}
+	ret = load_line_count;
+
+load_done:
+	for (i = 0; i < pieces; i++)
+		vi_free(MEM_LOAD, scan.pieces[i].nl, scan.pieces[i].nl_alloc * sizeof(long));
+	vi_free(MEM_LOAD, scan.pieces, (pieces + 1) * sizeof(struct load_piece));
+	vi_free(MEM_LOAD, scan.data, alloc);
+	return ret;
+}
+
+
+/* Save the buffer to the file specified
+ * The lines are written from a snapshot, so the writer does not care
+ * what happens to the live buffer while it runs. They go to a temporary
+ * file next to the original which is then renamed over it, so a write
+ * that fails or is cancelled leaves the original untouched. A file with
+ * other hard links or another owner would lose them to the rename, so it
+ * is overwritten in place, as is one whose directory takes no new file
+ * or whose group can't be kept; such a write can't be cancelled. */
+static int save_file(const char * const restrict name)
+{
+	FILE *fp;
+	struct snapshot *snap;
+	struct line *from;
+	const struct snap_line *line;
+	struct stat st;
+	const char *target = name;
+	char tmp[PATH_MAX + 16];
+#ifndef __ELKS__
+	char real[PATH_MAX];
+#endif	/* __ELKS__ */
+	int have_mode, in_place;
+	int fd = -1;
+	int i;
+	int ret = 0;
+
+	if (!name || *name == '\0') return -1;
+#ifndef __ELKS__
+	/* Replace the file a symlink points to, not the link */
+	if (realpath(name, real) != NULL) target = real;
+#endif	/* __ELKS__ */
+	have_mode = (stat(target, &st) == 0);
+	in_place = have_mode && (st.st_nlink > 1 || st.st_uid != geteuid());
+	if (!in_place && snprintf(tmp, sizeof(tmp), "%s.%d~", target,
+				(int)getpid()) < (int)sizeof(tmp))
+		fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL,
+				have_mode ? (st.st_mode & 07777) : 0666);
+#ifndef __ELKS__
+	/* Keep the original's group and permissions despite the directory
+	 * and the umask */
+	if (fd >= 0 && have_mode && (fchown(fd, st.st_uid, st.st_gid) != 0
+				|| fchmod(fd, st.st_mode & 07777) != 0)) {
+		close(fd);
+		unlink(tmp);
+		fd = -1;
+	}
+#endif	/* __ELKS__ */
+	if (fd >= 0) {
+		fp = fdopen(fd, "wb");
+		if (!fp) {
+			close(fd);
+			unlink(tmp);
+			return -1;
+		}
+	} else {
+		fp = fopen(target, "wb");
+		if (!fp) return -1;
+	}
+	from = line_head;
+	snap = snap_take(&from, line_count);
+	op_begin("Writing", snap->line_count);
+	for (i = 0; i < snap->line_count; i++) {
+		line = SNAP_LINE(snap, i);
+		if (fwrite(line->text, 1, line->len, fp) != (size_t)line->len
+				|| fputc('\n', fp) == EOF) {
+			ret = -1;
+			break;
+		}
+		if (fd >= 0 && (i & 4095) == 0 && op_progress(i)) {
+			strcpy(custom_status, "Write cancelled; file unchanged");
+			ret = -1;
+			break;
+		}
+	}
+	op_end();
+	snap_put(snap);
+	if (fflush(fp) != 0) ret = -1;
+#ifndef __ELKS__
+	if (fd >= 0 && ret == 0 && fsync(fileno(fp)) != 0) ret = -1;
+#endif	/* __ELKS__ */
+	if (fclose(fp) != 0) ret = -1;
+	if (fd < 0) return ret;
+	if (ret == 0 && rename(tmp, target) != 0) ret = -1;
+	if (ret != 0) unlink(tmp);
+	return ret;
+}
+
+
+/* A parallel search for a plain text pattern in a snapshot
+ * Lines are searched in order starting after the cursor line and
+ * wrapping around, a window at a time: 'snap' holds the lines that are
+ * 'base' to 'base' + snap->line_count after the cursor line. 'found'
+ * holds the best match seen so far as (distance from the line after
+ * the cursor << 32 | column) or -1. */
+#define SEARCH_NEAR 4096	/* lines searched before taking a snapshot */
+#define SEARCH_WINDOW 65536	/* first window; each one after is twice as big */
+struct search_job {
+	struct snapshot *snap;
+	const char *pattern;
+	int pattern_len;
+	long base;
+	volatile long long found;
+};
+
+/* Find needle in a length-delimited haystack; returns offset or -1 */
+static int find_text(const char *hay, int hay_len,
+		const char *needle, int needle_len)
+{
+	const char *p = hay;
+	const char *end = hay + hay_len - needle_len + 1;
+
+	if (needle_len == 0 || hay_len < needle_len) return -1;
+	while (p < end && (p = (const char *)memchr(p, *needle, end - p)) != NULL) {
+		if (memcmp(p, needle, needle_len) == 0) return (int)(p - hay);
+		p++;
+	}
+	return -1;
+}
+
+/* Pool task: search lines [start, end) counted from the start line */
+static void search_lines(void *arg, long start, long end)
+{
+	struct search_job *job = (struct search_job *)arg;
+	const struct snap_line *line;
+	long long hit, seen;
+	long i;
+	int col;
+
+	for (i = start; i < end; i++) {
+		/* A closer match was already found by someone else */
+#ifdef NO_THREADS
+		seen = job->found;
+#else
+		seen = __atomic_load_n(&job->found, __ATOMIC_RELAXED);
+#endif	/* NO_THREADS */
+		if (seen >= 0 && (seen >> 32) < job->base + i) break;
+		line = SNAP_LINE(job->snap, i);
+		col = find_text(line->text, line->len, job->pattern, job->pattern_len);
+		if (col < 0) continue;
+		hit = ((long long)(job->base + i) << 32) | col;
+#ifdef NO_THREADS
+		if (job->found < 0 || hit < job->found) job->found = hit;
+#else
+		seen = __atomic_load_n(&job->found, __ATOMIC_RELAXED);
+		while ((seen < 0 || hit < seen) && !__atomic_compare_exchange_n(
+					&job->found, &seen, hit, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+#endif	/* NO_THREADS */
+		break;
+	}
+	OP_DONE_ADD(end - start);
+	return;
+}
+
+
+/* Search forward from the cursor for a pattern, wrapping at the end;
+ * returns 0 if the cursor moved to a match */
+static int do_search(const char *pattern)
+{
+	struct search_job job;
+	struct line *line;
+	int col, len, cancelled, first, count, window;
+	long found_line;
+
+	len = strlen(pattern);
+	if (len == 0) {
+		strcpy(custom_status, "No previous search pattern");
+		return -1;
+	}
+
+	/* The rest of the current line comes first */
+	col = crsr_x + line_shift;
+	if (col < cur_line_s->len) {
+		first = find_text(cur_line_s->text + col, cur_line_s->len - col,
+				pattern, len);
+		if (first >= 0) {
+			jump_push();
+			crsr_to_col(col + first + 1);
+			return 0;
+		}
+	}
+
+	/* The next few lines are searched right in the list */
+	job.found = -1;
+	job.base = 0;
+	for (line = cur_line_s->next; line != NULL && job.base < SEARCH_NEAR;
+			line = line->next) {
+		col = find_text(line->text, line->len, pattern, len);
+		if (col >= 0) {
+			job.found = ((long long)job.base << 32) | col;
+			break;
+		}
+		job.base++;
+	}
+
+	/* Everything else, in parallel and in growing windows so a match
+	 * close by does not pay for snapshotting the whole buffer; the
+	 * current line is searched last */
+	job.pattern = pattern;
+	job.pattern_len = len;
+	window = SEARCH_WINDOW;
+	op_begin("Searching", line_count - job.base);
+	while (job.found < 0 && job.base < line_count && !op_token.cancelled) {
+		/* A window ends at the end of the buffer and the next one
+		 * starts over from the top */
+		if (line == NULL) line = line_head;
+		first = (int)((cur_line + job.base) % line_count);
+		count = window;
+		if (count > line_count - job.base) count = (int)(line_count - job.base);
+		if (count > line_count - first) count = line_count - first;
+		job.snap = snap_take(&line, count);
+		pool_run(search_lines, &job, job.snap->line_count, 4096, &op_token);
+		job.base += job.snap->line_count;
+		snap_put(job.snap);
+		if (window < line_count) window <<= 1;
+	}
+	cancelled = op_end();
+
+	if (cancelled) {
+		strcpy(custom_status, "Search interrupted");
+		return -1;
+	}
+	if (job.found < 0) {
+		snprintf(custom_status, MAX_STATUS, "Pattern not found: %s", pattern);
+		return -1;
+	}
+	found_line = (((job.found >> 32) + cur_line) % line_count) + 1;
+	if (found_line <= cur_line) strcpy(custom_status, "Search wrapped around");
+	jump_push();
+	jump_to_line((int)found_line);
+	crsr_to_col((int)(job.found & 0xffffffffLL) + 1);
+	return 0;
+}
+
+
+/* Character classes for word motions: blank, punctuation, word */
+static int word_class(char c, int big)
+{
+	if (c == ' ' || c == '\t') return 0;
+	if (big) return 1;
+	if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+			|| (c >= '0' && c <= '9') || c == '_') return 2;
+	return 1;
+}
+
+
+/* w/W: start of the next word, or the end of the line */
+static int word_forward(const char *text, int len, int pos, int big)
+{
+	int cls;
+
+	if (pos >= len) return len;
+	cls = word_class(text[pos], big);
+	if (cls != 0) while (pos < len && word_class(text[pos], big) == cls) pos++;
+	while (pos < len && word_class(text[pos], big) == 0) pos++;
+	return pos;
+}
+
+
+/* e/E: last character of the word after 'pos' (or of the one it is in
+ * if 'here' is set) */
+static int word_end(const char *text, int len, int pos, int big, int here)
+{
+	int cls;
+
+	if (!here) pos++;
+	while (pos < len && word_class(text[pos], big) == 0) pos++;
+	if (pos >= len) return len - 1;
+	cls = word_class(text[pos], big);
+	while (pos + 1 < len && word_class(text[pos + 1], big) == cls) pos++;
+	return pos;
+}
+
+
+/* b/B: start of this word or the previous one */
+static int word_back(const char *text, int len, int pos, int big)
+{
+	int cls;
+
+	if (pos > len) pos = len;
+	if (pos <= 0) return 0;
+	pos--;
+	while (pos > 0 && word_class(text[pos], big) == 0) pos--;
+	cls = word_class(text[pos], big);
+	while (pos > 0 && word_class(text[pos - 1], big) == cls) pos--;
+	return pos;
+}
+
+
+/* Work out the range operator 'op' covers with a motion, into cur_movement
+ * A doubled operator ('cc') covers 'count' whole lines, as do j and k;
+ * these set dest_char to 0 and return 1. Other motions stay on the
+ * cursor line: [start_char, dest_char) is the span and 0 is returned.
+ * Returns -1 if the motion is unknown or can't be done. */
+static int set_movement(char op, char motion, char arg, int count)
+{
+	const char *text = cur_line_s->text;
+	const char *p;
+	int len = cur_line_s->len;
+	int pos = crsr_x + line_shift - 1;
+	int dest, inclusive = 0, big, i;
+
+	if (count < 1) count = 1;
+	if (pos > len) pos = len;
+	dest = pos;
+	big = (motion >= 'A' && motion <= 'Z');
+	cur_movement.motion = motion;
+	cur_movement.motion_arg = arg;
+	cur_movement.count = count;
+	cur_movement.start_line = cur_line;
+	cur_movement.start_char = pos + 1;
+	cur_movement.dest_line = 0;
+	cur_movement.dest_char = 0;
+
+	if (motion == op) motion = '_';
+	switch (motion) {
+	case '_':	/* whole lines */
+		if (count > line_count - cur_line + 1) count = line_count - cur_line + 1;
+		cur_movement.dest_line = count;
+		return 1;
+	case 'j':
+		if (cur_line + count > line_count) return -1;
+		cur_movement.dest_line = count + 1;
+		return 1;
+	case 'k':
+		if (cur_line - count < 1) return -1;
+		cur_movement.start_line = cur_line - count;
+		cur_movement.dest_line = count + 1;
+		return 1;
+	case 'h':
+		dest = pos - count;
+		break;
+	case 'l':
+	case ' ':
+		dest = pos + count;
+		break;
+	case '0':
+		dest = 0;
+		break;
+	case '^':
+		for (dest = 0; dest < len && word_class(text[dest], 1) == 0; dest++);
+		break;
+	case '$':
+		dest = len;
+		break;
+	case 'w':
+	case 'W':
+		if (op == 'c' && pos < len && word_class(text[pos], big) != 0) {
+			/* cw stops at the end of the word like ce */
+			dest = word_end(text, len, pos, big, 1);
+			for (i = 1; i < count; i++) dest = word_end(text, len, dest, big, 0);
+			inclusive = 1;
+		} else for (i = 0; i < count; i++) dest = word_forward(text, len, dest, big);
+		break;
+	case 'e':
+	case 'E':
+		for (i = 0; i < count; i++) dest = word_end(text, len, dest, big, 0);
+		inclusive = 1;
+		break;
+	case 'b':
+	case 'B':
+		for (i = 0; i < count; i++) dest = word_back(text, len, dest, big);
+		break;
+	case 'f':
+	case 't':
+		for (i = 0; i < count; i++) {
+			if (dest + 1 >= len) return -1;
+			p = (const char *)memchr(text + dest + 1, arg, len - dest - 1);
+			if (p == NULL) return -1;
+			dest = p - text;
+		}
+		if (motion == 't') dest--;
+		inclusive = 1;
+		break;
+	case 'F':
+	case 'T':
+		for (i = 0; i < count; i++) {
+			for (dest--; dest >= 0 && text[dest] != arg; dest--);
+			if (dest < 0) return -1;
+		}
+		if (motion == 'T') dest++;
+		break;
+	default:
+		return -1;
+	}
+
+	if (inclusive && dest >= pos) dest++;
+	if (dest < 0) dest = 0;
+	if (dest > len) dest = len;
+	if (dest < pos) {
+		cur_movement.start_char = dest + 1;
+		cur_movement.dest_char = pos + 1;
+	} else cur_movement.dest_char = dest + 1;
+	return 0;
+}
+
+
+/* Get a movement subcommand for operator 'op' and set cur_movement
+ * Returns 0 for a movement within the line, 1 for whole lines ('cc' or
+ * a line motion) and -1 on invalid movement or ESC */
+static int get_movement(char op, int num_times)
+{
+	char c, arg = 0;
+	int count = 0;
+
+	while (read_mapped_key(&c, MAP_NONE)) {
+		/* Handle numbers first */
+		if ((c >= '1' && c <= '9') || (c == '0' && count > 0)) {
+			count = count * 10 + c - '0';
 			continue;
 		}
+		if (c == '\033') return -1;
+		if (count > 0) num_times *= count;
+		if (c == 'f' || c == 'F' || c == 't' || c == 'T') {
+			if (!read_mapped_key(&arg, MAP_NONE) || arg == '\033') return -1;
+		}
+		return set_movement(op, c, arg, num_times);
+	}
+	return -1;
+}
+
+
+/* Delete 'count' lines starting at the cursor line
+ * The whole range is unlinked in one pass, handed to the undo log
+ * as-is and the screen is redrawn once. */
+static void delete_lines(int count)
+{
+	struct line *removed, *prev;
+	int start = cur_line;
+	int new_count = 0;
+
+	if (count > line_count - cur_line + 1) count = line_count - cur_line + 1;
+	if (count < 1) return;
+	/* Deleting the only empty line does nothing */
+	if (line_count == 1 && cur_line_s->len == 0) return;
+
+	prev = cur_line_s->prev;
+	removed = lines_unlink(start, count);
+	/* The buffer always keeps at least one line */
+	if (line_head == NULL) {
+		alloc_new_line(0, NULL, &line_count, &line_head);
+		new_count = 1;
+	}
+	undo_take(start, removed, count, new_count);
+
+	if (start <= line_count) {
+		cur_line_s = (prev != NULL) ? prev->next : line_head;
+		cur_line = start;
+	} else {
+		/* Deleted through the end; land on the new last line */
+		cur_line_s = prev;
+		cur_line = start - 1;
+		if (crsr_y > 1) crsr_y--;
+	}
+	crsr_x = 1;
+	line_shift = 0;
+	redraw_screen(0, 0);
+	if (count >= 3) sprintf(custom_status, "Deleted %d lines at %d", count, cur_line);
+	return;
+}
+
+
+/* Whether J puts a space between 'last' and the next line's text */
+static inline int join_space(char last, const struct line *line, int skip)
+{
+	if (last == '\0' || last == ' ' || last == '\t') return 0;
+	if (skip >= line->len || line->text[skip] == ')') return 0;
+	return 1;
+}
+
+
+/* Join 'count' lines from 'start' into one; with 'spaces' set, leading
+ * blanks are dropped and pieces are separated by a space like J does
+ * The joined length is worked out first so the text is allocated once,
+ * exactly sized, and each piece is copied once; the joined lines are
+ * then unlinked in one go. Returns the offset of the last join. */
+static int join_lines(int start, int count, int spaces)
+{
+	struct line *first, *line, *removed;
+	char *text;
+	char last;
+	int i, skip, total, pos, joint = 0;
+
+	if (count < 2) count = 2;
+	if (count > line_count - start + 1) count = line_count - start + 1;
+	if (count < 2) {
+		strcpy(custom_status, "Nothing to join");
+		return crsr_x + line_shift - 1;
+	}
+	if (start != cur_line) jump_to_edit(start);
+	undo_begin(start, count);
+	first = cur_line_s;
+
+	/* Measure */
+	total = first->len;
+	last = total ? first->text[total - 1] : '\0';
+	for (i = 1, line = first->next; i < count; i++, line = line->next) {
+		skip = 0;
+		if (spaces) {
+			while (skip < line->len && word_class(line->text[skip], 1) == 0) skip++;
+			total += join_space(last, line, skip);
+		}
+		total += line->len - skip;
+		if (line->len > skip) last = line->text[line->len - 1];
+	}
+
+	/* Copy */
+	text = (char *)vi_malloc(MEM_TEXT, total + 1);
+	if (!text) oom();
+	memcpy(text, first->text, first->len);
+	pos = first->len;
+	for (i = 1, line = first->next; i < count; i++, line = line->next) {
+		skip = 0;
+		joint = pos;
+		if (spaces) {
+			while (skip < line->len && word_class(line->text[skip], 1) == 0) skip++;
+			if (join_space(pos ? text[pos - 1] : '\0', line, skip)) text[pos++] = ' ';
+		}
+		memcpy(text + pos, line->text + skip, line->len - skip);
+		pos += line->len - skip;
+	}
+	text[pos] = '\0';
+	line_free_text(first);
+	first->text = text;
+	first->text_epoch = buf_epoch;
+	first->len = pos;
+	first->alloc_size = total + 1;
+
+	removed = lines_unlink(start + 1, count - 1);
+	destroy_buffer(&removed);
+	undo_end();
+	redraw_screen(0, 0);
+	return joint;
+}
+
+
+/* Shift 'count' lines from 'start' right (dir > 0) or left by 'times'
+ * shiftwidths. Indents are rebuilt with tabs (every 8 columns) and
+ * spaces, or only spaces with expandtab, and blank lines are left
+ * alone. A line is reallocated at most once and the whole range is one
+ * undo record and one redraw. */
+static void shift_lines(int start, int count, int dir, int times)
+{
+	struct line *line;
+	int i, ws, width, new_width, tabs, new_ws, delta;
+
+	if (count > line_count - start + 1) count = line_count - start + 1;
+	if (count < 1 || shift_width < 1) return;
+	if (start != cur_line) jump_to_edit(start);
+	undo_begin(start, count);
+	for (i = 0, line = cur_line_s; i < count; i++, line = line->next) {
+		width = 0;
+		for (ws = 0; ws < line->len; ws++) {
+			if (line->text[ws] == ' ') width++;
+			else if (line->text[ws] == '\t') width = (width + 8) & ~7;
+			else break;
+		}
+		if (ws == line->len) continue;
+		new_width = width + dir * times * shift_width;
+		if (new_width < 0) new_width = 0;
+		tabs = expand_tab ? 0 : new_width / 8;
+		new_ws = tabs + new_width - tabs * 8;
+		delta = new_ws - ws;
+		if (delta > 0) line_reserve(line, line->len + delta);
+		else line_cow(line);
+		if (delta != 0) memmove(line->text + new_ws, line->text + ws,
+				line->len - ws + 1);
+		memset(line->text, '\t', tabs);
+		memset(line->text + tabs, ' ', new_ws - tabs);
+		line->len += delta;
+	}
+	undo_end();
+	redraw_screen(0, 0);
+	if (count >= 3) snprintf(custom_status, MAX_STATUS, "%d lines %ced %d time%s",
+			count, dir > 0 ? '>' : '<', times, times > 1 ? "s" : "");
+	crsr_to_col(1);
+	return;
+}
+
+
+#define CASE_UPPER 0
+#define CASE_LOWER 1
+#define CASE_TOGGLE 2
+
+/* Change the case of 'len' bytes of text in place
+ * Pure ASCII goes 16 bytes at a time with SSE2. From the first block
+ * with a non-ASCII byte on, the rest is done a byte at a time, which
+ * also folds the Latin-1 letters of UTF-8 (U+00C0-U+00FE). */
+static void case_convert(char *text, int len, int mode)
+{
+	unsigned char *p = (unsigned char *)text;
+	unsigned char c;
+	int i = 0;
+#ifdef __SSE2__
+	__m128i v, upper, lower, flip;
+	const __m128i bit = _mm_set1_epi8(0x20);
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		if (_mm_movemask_epi8(v) != 0) break;
+		upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+				_mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+		lower = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a' - 1)),
+				_mm_cmplt_epi8(v, _mm_set1_epi8('z' + 1)));
+		if (mode == CASE_UPPER) flip = lower;
+		else if (mode == CASE_LOWER) flip = upper;
+		else flip = _mm_or_si128(upper, lower);
+		v = _mm_xor_si128(v, _mm_and_si128(flip, bit));
+		_mm_storeu_si128((__m128i *)(p + i), v);
+	}
+#endif	/* __SSE2__ */
+	for (; i < len; i++) {
+		c = p[i];
+		if (c >= 'a' && c <= 'z') {
+			if (mode != CASE_LOWER) p[i] = c - 0x20;
+		} else if (c >= 'A' && c <= 'Z') {
+			if (mode != CASE_UPPER) p[i] = c + 0x20;
+		} else if (c == 0xc3 && i + 1 < len) {
+			c = p[++i];
+			if (c >= 0x80 && c <= 0x9e && c != 0x97) {
+				if (mode != CASE_UPPER) p[i] = c + 0x20;
+			} else if (c >= 0xa0 && c <= 0xbe && c != 0xb7) {
+				if (mode != CASE_LOWER) p[i] = c - 0x20;
+			}
+		}
+	}
+	return;
+}
+
+
+/* Change the case of what cur_movement covers ('type' from
+ * set_movement()) as one undo record, redrawing once */
+static void case_range(int type, int mode)
+{
+	struct line *line;
+	int i, from;
+
+	if (type < 0) {
+		strcpy(custom_status, "Invalid motion");
+		return;
+	}
+	if (type == 1) {
+		if (cur_movement.start_line != cur_line) jump_to_edit(cur_movement.start_line);
+		undo_begin(cur_line, cur_movement.dest_line);
+		for (i = 0, line = cur_line_s; i < cur_movement.dest_line; i++, line = line->next) {
+			line_cow(line);
+			case_convert(line->text, line->len, mode);
+		}
+		undo_end();
+		redraw_screen(0, 0);
+		crsr_to_col(crsr_x + line_shift);
+		return;
+	}
+	from = cur_movement.start_char - 1;
+	undo_begin(cur_line, 1);
+	line_cow(cur_line_s);
+	case_convert(cur_line_s->text + from, cur_movement.dest_char - 1 - from, mode);
+	undo_end();
+	crsr_to_col(from + 1);
+	return;
+}
+
+
+/* ~: toggle the case of 'count' characters and move past them */
+static void toggle_case(int count)
+{
+	int pos = crsr_x + line_shift - 1;
+
+	if (pos >= cur_line_s->len) return;
+	if (count > cur_line_s->len - pos) count = cur_line_s->len - pos;
+	undo_begin(cur_line, 1);
+	line_cow(cur_line_s);
+	case_convert(cur_line_s->text + pos, count, CASE_TOGGLE);
+	undo_end();
+	if (crsr_x + count - 1 <= term_cols) {
+		paint_cells(cur_line_s->text + pos, count);
+		crsr_to_pos(pos + count < cur_line_s->len ? pos + count : cur_line_s->len - 1);
+	} else crsr_to_col(pos + count + 1);
+	return;
+}
 
-		/* Newline or carriage return */
-		if (cc == '\n' || cc == '\r') {
-			command[cmdsize] = '\0';
-			break;
+
+/* Delete 'count' chars at (or with 'left' set, before) the cursor
+ * with a single memmove and redraw */
+static void delete_chars(int count, int left)
+{
+	struct line *line = cur_line_s;
+	int pos = crsr_x + line_shift - 1;
+
+	if (pos > line->len) pos = line->len;
+	if (left) {
+		if (count > pos) count = pos;
+		pos -= count;
+	} else if (count > line->len - pos) count = line->len - pos;
+	if (count <= 0) return;
+
+	undo_begin(cur_line, 1);
+	line_cow(line);
+	memmove(line->text + pos, line->text + pos + count, line->len - pos - count + 1);
+	line->len -= count;
+	undo_end();
+	crsr_to_col(pos + 1);
+	return;
+}
+
+
+/* Move the cursor 'delta' lines down (or up), redrawing only once */
+static void move_lines(int delta)
+{
+	int row = line_row(cur_line);
+	int target = row + delta;
+	int col = crsr_x + line_shift;
+
+	/* Count in screen rows so a closed fold is one step */
+	if (target < 1) target = 1;
+	if (target > line_row(line_count)) target = line_row(line_count);
+	if (target == row) return;
+	if (target == row + 1) {
+		do_cursor_down();
+		return;
+	}
+	if (target == row - 1) {
+		do_cursor_up();
+		return;
+	}
+	/* Put back the old line unshifted if it was scrolled sideways */
+	if (line_shift > 0) {
+		line_shift = 0;
+		redraw_line(cur_line_s, crsr_y);
+	}
+	crsr_y += target - row;
+	cur_line_s = find_line(row_line(target));
+	cur_line = row_line(target);
+	if (crsr_y < 1 || crsr_y > term_rows) {
+		/* Scroll just far enough to show the target line */
+		crsr_y = (crsr_y < 1) ? 1 : term_rows;
+		if (crsr_y > target) crsr_y = target;
+		line_shift = 0;
+		redraw_screen(0, 0);
+	}
+	crsr_to_col(col);
+	return;
+}
+
+
+/* Record the change a command just made for '.' */
+static void set_last_change(char op, char motion, int count)
+{
+	last_change.op = op;
+	last_change.motion = motion;
+	last_change.count = count;
+	last_change.text_len = 0;
+	return;
+}
+
+
+/* Insert the text typed for the last change again
+ * 'o' opens a new line for every copy; 'a' and 'i' insert after or
+ * at the cursor. */
+static void repeat_insert(char op, int count)
+{
+	int pos;
+
+	if (op == 'o') {
+		undo_begin(cur_line + 1, 0);
+		while (count-- > 0) {
+			insert_text("\n", 1, 1, cur_line_s->len);
+			insert_text(last_change.text, last_change.text_len, 1, 0);
 		}
-		write(STDOUT_FILENO, &cc, 1);
-		command[cmdsize] = cc;
-		cmdsize++;
-		if (cmdsize == MAX_CMDSIZE) break;
+	} else {
+		undo_begin(cur_line, 1);
+		pos = crsr_x + line_shift - 1;
+		if (op == 'a' && cur_line_s->len > 0) pos++;
+		insert_text(last_change.text, last_change.text_len, count, pos);
 	}
-	return cmdsize;
+	undo_end();
+	return;
 }
 
 
-static void do_cursor_left(void)
+/* Type 'text' over the current line 'count' times starting at offset
+ * 'pos', growing the line only past its end. A '\n' breaks the line as
+ * it does when typed in replace mode. */
+static void replace_text(const char *text, int len, int count, int pos)
 {
-	if (crsr_x == 1) {
-		if (line_shift > 0) {
-			line_shift_reduce(1);
-			redraw_line(cur_line_s, crsr_y);
+	const char *p, *end = text + len;
+
+	if (len <= 0 || count < 1) return;
+	while (count-- > 0) {
+		for (p = text; p < end; p++) {
+			if (*p == '\n') {
+				insert_text("\n", 1, 1, pos);
+				pos = 0;
+				continue;
+			}
+			if (pos >= cur_line_s->len) {
+				line_reserve(cur_line_s, pos + 1);
+				cur_line_s->len = pos + 1;
+				cur_line_s->text[pos + 1] = '\0';
+			} else line_cow(cur_line_s);
+			cur_line_s->text[pos++] = *p;
 		}
+	}
+	crsr_to_col(pos);
+	return;
+}
+
+
+/* r: replace 'count' characters under the cursor with 'c' in place
+ * Returns 1 if there aren't that many characters to replace. */
+static int replace_chars(char c, int count)
+{
+	int pos = crsr_x + line_shift - 1;
+
+	if (pos + count > cur_line_s->len) {
+		strcpy(custom_status, "Not enough characters to replace");
+		return 1;
+	}
+	undo_begin(cur_line, 1);
+	line_cow(cur_line_s);
+	if (c == '\r' || c == '\n') {
+		/* The characters turn into one line break */
+		memmove(cur_line_s->text + pos, cur_line_s->text + pos + count,
+				cur_line_s->len - pos - count + 1);
+		cur_line_s->len -= count;
+		insert_text("\n", 1, 1, pos);
+	} else {
+		memset(cur_line_s->text + pos, c, count);
+		if (crsr_x + count - 1 <= term_cols) {
+			paint_cells(cur_line_s->text + pos, count);
+			crsr_x += count - 1;
+		} else crsr_to_col(pos + count);
+	}
+	undo_end();
+	return 0;
+}
+
+
+/* Empty 'count' lines from 'start' down to one blank line for a change */
+static void clear_lines(int start, int count)
+{
+	struct line *removed;
+
+	if (start != cur_line) jump_to_edit(start);
+	removed = lines_unlink(start + 1, count - 1);
+	destroy_buffer(&removed);
+	line_cow(cur_line_s);
+	cur_line_s->len = 0;
+	cur_line_s->text[0] = '\0';
+	crsr_x = 1;
+	line_shift = 0;
+	if (count > 1) redraw_screen(0, 0);
+	else redraw_line(cur_line_s, crsr_y);
+	return;
+}
+
+
+/* Replace [from, to) of the current line with 'text'
+ * Text without line breaks moves the tail once, whichever way it has to
+ * go, and is copied straight into the gap. */
+static void splice_text(int from, int to, const char *text, int len)
+{
+	struct line *line = cur_line_s;
+
+	if (memchr(text, '\n', len) != NULL) {
+		line_cow(line);
+		memmove(line->text + from, line->text + to, line->len - to + 1);
+		line->len -= to - from;
+		insert_text(text, len, 1, from);
 		return;
-	} else CRSR_LEFT();
-	crsr_x--;
+	}
+	line_reserve(line, line->len - (to - from) + len);
+	memmove(line->text + from + len, line->text + to, line->len - to + 1);
+	memcpy(line->text + from, text, len);
+	line->len += len - (to - from);
+	crsr_to_col(from + len);
 	return;
 }
 
-static void do_cursor_right(void)
+
+/* '.' for a change: redo the motion here and put the same text in */
+static void repeat_change_text(int count)
 {
-	if (crsr_x > cur_line_s->len) return;
-	if (crsr_x == term_cols) {
-		if ((cur_line_s->len - line_shift) > term_cols) {
-			line_shift_increase(1);
-			redraw_line(cur_line_s, crsr_y);
-		} else {
-			oh_dear_god_no("cmd: l: term_cols check");
-			return;
+	int type;
+
+	type = set_movement('c', last_change.motion, last_change.motion_arg, count);
+	if (type < 0) {
+		strcpy(custom_status, "Invalid motion");
+		return;
+	}
+	if (type == 1) {
+		undo_begin(cur_movement.start_line, cur_movement.dest_line);
+		clear_lines(cur_movement.start_line, cur_movement.dest_line);
+		insert_text(last_change.text, last_change.text_len, 1, 0);
+	} else {
+		undo_begin(cur_line, 1);
+		splice_text(cur_movement.start_char - 1, cur_movement.dest_char - 1,
+				last_change.text, last_change.text_len);
+	}
+	undo_end();
+	return;
+}
+
+
+/* Repeat the last change, with a new count if one is given */
+static void repeat_change(int count)
+{
+	int i;
+
+	if (count < 1) count = last_change.count;
+	switch (last_change.op) {
+	case 'd':
+		delete_lines(count);
+		break;
+	case 'x':
+	case 'X':
+		delete_chars(count, last_change.op == 'X');
+		break;
+	case 'a':
+	case 'i':
+	case 'o':
+		repeat_insert(last_change.op, count);
+		break;
+	case 'c':
+		repeat_change_text(count);
+		break;
+	case 'J':
+		crsr_to_col(join_lines(cur_line, count, 1) + 1);
+		break;
+	case '>':
+	case '<':
+		i = set_movement(last_change.op, last_change.motion,
+				last_change.motion_arg, count);
+		if (i >= 0) shift_lines(cur_movement.start_line,
+				i ? cur_movement.dest_line : 1,
+				last_change.op == '>' ? 1 : -1, 1);
+		break;
+	case '~':
+		toggle_case(count);
+		break;
+	case 'U':
+	case 'u':
+	case 'g':
+		i = (last_change.op == 'g') ? '~' : last_change.op;
+		case_range(set_movement(i, last_change.motion, last_change.motion_arg, count),
+				last_change.op == 'U' ? CASE_UPPER
+				: (last_change.op == 'u' ? CASE_LOWER : CASE_TOGGLE));
+		break;
+	case 'r':
+		replace_chars(last_change.motion, count);
+		break;
+	case 'R':
+		undo_begin(cur_line, 1);
+		replace_text(last_change.text, last_change.text_len, count,
+				crsr_x + line_shift - 1);
+		undo_end();
+		break;
+	default:
+		strcpy(custom_status, "Nothing to repeat");
+		return;
+	}
+	last_change.count = count;
+	return;
+}
+
+
+/* Run insert mode for 'i', 'a' and 'o', then insert the typed text
+ * another count - 1 times */
+static void insert_mode(char op, int count)
+{
+	set_last_change(op, 0, count);
+	vi_mode = MODE_INSERT;
+	update_status();
+	insert_capture = 1;
+	edit_mode();
+	insert_capture = 0;
+	if (count < 2 || last_change.text_len == 0) return;
+	if (op == 'o') {
+		while (--count > 0) {
+			insert_text("\n", 1, 1, cur_line_s->len);
+			insert_text(last_change.text, last_change.text_len, 1, 0);
 		}
+	} else if (last_change.text[last_change.text_len - 1] == '\n') {
+		insert_text(last_change.text, last_change.text_len, count - 1, 0);
 	} else {
-		/* Only move one space beyond end when in edit mode */
-		if ((crsr_x < (cur_line_s->len - line_shift)) ||
-			(vi_mode > 0 &&
-			crsr_x == (cur_line_s->len - line_shift))) {
-			crsr_x++;
-			CRSR_RIGHT();
+		insert_text(last_change.text, last_change.text_len, count - 1,
+				crsr_x + line_shift);
+	}
+	return;
+}
+
+
+/* Run replace mode for 'R', then type the text over another
+ * count - 1 times */
+static void replace_mode(int count)
+{
+	set_last_change('R', 0, count);
+	vi_mode = MODE_REPLACE;
+	replace_saved = 0;
+	replace_typed = 0;
+	update_status();
+	insert_capture = 1;
+	edit_mode();
+	insert_capture = 0;
+	if (count < 2 || last_change.text_len == 0) return;
+	replace_text(last_change.text, last_change.text_len, count - 1,
+			crsr_x + line_shift);
+	return;
+}
+
+
+/* c{motion}, cc, C, s and S; 'motion' is 'c' for whole lines
+ * The changed span becomes the insert gap: typing overwrites it in place
+ * (its end is marked with '$' as in vi) and ESC closes whatever is left
+ * of it with one memmove. */
+static void change_text(int type)
+{
+	int from, to, col;
+
+	if (type < 0) {
+		strcpy(custom_status, "Invalid motion");
+		return;
+	}
+	set_last_change('c', cur_movement.motion, cur_movement.count);
+	last_change.motion_arg = cur_movement.motion_arg;
+	if (type == 1) {
+		undo_begin(cur_movement.start_line, cur_movement.dest_line);
+		clear_lines(cur_movement.start_line, cur_movement.dest_line);
+	} else {
+		undo_begin(cur_line, 1);
+		from = cur_movement.start_char - 1;
+		to = cur_movement.dest_char - 1;
+		crsr_to_pos(from);
+		change_gap_start = from;
+		change_gap_end = to;
+		col = to - line_shift;
+		if (to > from && col <= term_cols && !render_suppressed) {
+			crsr_yx(crsr_y, col);
+			term_write("$", 1);
 		}
 	}
+	vi_mode = MODE_INSERT;
+	update_status();
+	insert_capture = 1;
+	edit_mode();
+	insert_capture = 0;
+	undo_end();
 	return;
 }
 
 
-static void do_cursor_up(void)
+/* Parse a line address: a number, '.', '$' or 'x, then any +N/-N offsets */
+static char *parse_address(char *p, int *line)
 {
-	int temp_shift = line_shift;
+	int n;
+
+	if (*p >= '0' && *p <= '9') *line = (int)strtol(p, &p, 10);
+	else if (*p == '.') {
+		*line = cur_line;
+		p++;
+	} else if (*p == '$') {
+		*line = line_count;
+		p++;
+	} else if (*p == '\'' && p[1] >= 'a' && p[1] <= 'z') {
+		*line = line_number(marks[p[1] - 'a'].line);
+		p += 2;
+	} else if (*p == '+' || *p == '-') *line = cur_line;
+	else return NULL;
+	while (*p == '+' || *p == '-') {
+		n = (p[1] >= '0' && p[1] <= '9') ? (int)strtol(p + 1, NULL, 10) : 1;
+		*line += (*p == '+') ? n : -n;
+		for (p++; *p >= '0' && *p <= '9'; p++);
+	}
+	return p;
+}
+
+
+/* Parse the line range in front of an ex command ('%', 'n', 'n,m')
+ * Without a range both ends are the current line. Returns the command
+ * after the range or NULL if an address is out of range. */
+static char *parse_range(char *command, int *first, int *last)
+{
+	char *p;
+
+	*first = *last = cur_line;
+	if (*command == '%') {
+		*first = 1;
+		*last = line_count;
+		return command + 1;
+	}
+	p = parse_address(command, first);
+	if (p == NULL) return command;
+	*last = *first;
+	if (*p == ',') {
+		p = parse_address(p + 1, last);
+		if (p == NULL) return NULL;
+	}
+	if (*first < 1 || *last > line_count || *first > *last) return NULL;
+	return p;
+}
+
+
+/* :j[oin][!] over a range; a single line joins with the one after it */
+static int ex_join(char *command, int first, int last)
+{
+	int spaces = 1;
+
+	if (strncmp(command, "join", 4) == 0) command += 4;
+	else if (*command == 'j') command++;
+	else return 0;
+	if (*command == '!') {
+		spaces = 0;
+		command++;
+	}
+	if (*command != '\0') return 0;
+	crsr_to_col(join_lines(first, last - first + 1, spaces) + 1);
+	return 1;
+}
+
+
+/* >{motion} and <{motion}: a motion within the line shifts just it */
+static void shift_motion(char op, int num_times)
+{
+	int type;
+
+	type = get_movement(op, num_times);
+	if (type < 0) return;
+	shift_lines(cur_movement.start_line, type ? cur_movement.dest_line : 1,
+			op == '>' ? 1 : -1, 1);
+	set_last_change(op, cur_movement.motion, cur_movement.count);
+	last_change.motion_arg = cur_movement.motion_arg;
+	return;
+}
+
+
+/* gU, gu and g~ followed by a motion; gUU, guu and g~~ do whole lines */
+static void case_motion(int num_times)
+{
+	char c;
+	int type;
+
+	if (!read_mapped_key(&c, MAP_NONE)) return;
+	if (c != 'U' && c != 'u' && c != '~') {
+		if (c != '\033') strcpy(custom_status, "Unknown g command");
+		return;
+	}
+	type = get_movement(c, num_times);
+	case_range(type, c == 'U' ? CASE_UPPER : (c == 'u' ? CASE_LOWER : CASE_TOGGLE));
+	if (type < 0) return;
+	set_last_change(c == '~' ? 'g' : c, cur_movement.motion, cur_movement.count);
+	last_change.motion_arg = cur_movement.motion_arg;
+	return;
+}
+
+
+/* :> and :< over a range; each extra '>' or '<' shifts once more */
+static int ex_shift(char *command, int first, int last)
+{
+	int times = 0;
+	char dir = *command;
+
+	if (dir != '>' && dir != '<') return 0;
+	while (*command == dir) {
+		command++;
+		times++;
+	}
+	while (*command == ' ') command++;
+	if (*command != '\0') return 0;
+	shift_lines(first, last - first + 1, dir == '>' ? 1 : -1, times);
+	return 1;
+}
+
+
+/* Put a closed fold into the table in line order */
+static void fold_add(struct line *start, struct line *end, int first, int last)
+{
+	struct fold *f;
+	int i;
+
+	if (fold_count == fold_alloc) {
+		i = fold_alloc ? fold_alloc * 2 : 16;
+		f = (struct fold *)vi_realloc(MEM_FOLD, folds,
+				sizeof(struct fold) * fold_alloc, sizeof(struct fold) * i);
+		if (!f) oom();
+		folds = f;
+		fold_alloc = i;
+	}
+	for (i = fold_count; i > 0 && folds[i - 1].start_num > first; i--)
+		folds[i] = folds[i - 1];
+	f = &folds[i];
+	f->start = start;
+	f->end = end;
+	f->start_num = first;
+	f->end_num = last;
+	f->closed = 1;
+	start->flags |= LINE_FOLD;
+	end->flags |= LINE_FOLD;
+	fold_count++;
+	folds_closed++;
+	return;
+}
+
+
+/* Fold lines 'first' to 'last'
+ * Folds don't nest, so a new one replaces any it overlaps. */
+static int fold_create(int first, int last)
+{
+	int i, j;
+
+	if (first > last) {
+		i = first;
+		first = last;
+		last = i;
+	}
+	if (first < 1) first = 1;
+	if (last > line_count) last = line_count;
+	if (first == last) return 1;
+	for (i = j = 0; i < fold_count; i++) {
+		if (folds[i].start_num <= last && folds[i].end_num >= first) {
+			if (folds[i].closed) folds_closed--;
+			continue;
+		}
+		folds[j++] = folds[i];
+	}
+	fold_count = j;
+	fold_add(find_line(first), find_line(last), first, last);
+	return 0;
+}
+
 
+/* Keep the cursor on a shown line and the top row in place after folds
+ * open or close ('top' is the line that was at the top) */
+static void fold_view(int top)
+{
+	struct fold *f;
+	int row;
+
+	f = folds_closed ? fold_holding(cur_line, 1) : NULL;
+	if (f != NULL) {
+		cur_line_s = f->start;
+		cur_line = f->start_num;
+	}
+	row = line_row(cur_line);
+	crsr_y = row - line_row(top) + 1;
+	if (crsr_y < 1) crsr_y = 1;
+	if (crsr_y > term_rows) crsr_y = term_rows;
+	if (crsr_y > row) crsr_y = row;
 	line_shift = 0;
-	redraw_line(cur_line_s, crsr_y);
-	line_shift = temp_shift;
-	if (cur_line == 1) return;
-	if (cur_line_s->prev == NULL) return;
-	cur_line_s = cur_line_s->prev;
-	cur_line--;
-	if (crsr_y > 1) crsr_y--;
-//	else redraw_screen(0, 0);
-	else {
-		SCROLL_UP();
+	if (crsr_x > cur_line_s->len) crsr_x = cur_line_s->len;
+	if (crsr_x < 1) crsr_x = 1;
+	redraw_screen(0, 0);
+	return;
+}
+
+
+/* Open the closed fold holding line 'num' before something edits it */
+static void fold_open_line(int num)
+{
+	struct fold *f;
+	int top;
+
+	f = fold_holding(num, 1);
+	if (f == NULL) return;
+	top = screen_top();
+	f->closed = 0;
+	folds_closed--;
+	fold_view(top);
+	return;
+}
+
+
+/* Open the closed fold under the cursor before something edits it */
+static void fold_open_cursor(void)
+{
+	fold_open_line(cur_line);
+	return;
+}
+
+
+/* :fold over a range, and :foldindent, which folds every run of
+ * indented lines (blank lines inside a run go with it) in one pass */
+static int ex_fold(char *command, int first, int last)
+{
+	struct line *line, *run_line = NULL, *end_line = NULL;
+	int top = screen_top();
+	int num, run = 0, end = 0, indent;
+	const char *p;
+
+	if (strcmp(command, "fold") == 0 || strcmp(command, "fo") == 0) {
+		if (fold_create(first, last))
+			strcpy(custom_status, "A fold needs two or more lines");
+		fold_view(top);
+		return 1;
+	}
+	if (strcmp(command, "foldindent") != 0) return 0;
+	fold_count = 0;
+	folds_closed = 0;
+	for (line = line_head, num = 1; line != NULL; line = line->next, num++) {
+		for (p = line->text, indent = 0; p < line->text + line->len; p++) {
+			if (*p == ' ') indent++;
+			else if (*p == '\t') indent = (indent / 8 + 1) * 8;
+			else break;
+		}
+		if (p == line->text + line->len) continue;	/* blank */
+		if (indent >= shift_width && indent > 0) {
+			if (run == 0) {
+				run = num;
+				run_line = line;
+			}
+			end = num;
+			end_line = line;
+			continue;
+		}
+		if (run != 0 && end > run) fold_add(run_line, end_line, run, end);
+		run = 0;
+	}
+	if (run != 0 && end > run) fold_add(run_line, end_line, run, end);
+	snprintf(custom_status, MAX_STATUS, "%d folds", fold_count);
+	fold_view(top);
+	return 1;
+}
+
+
+/* z commands: zf{motion}, zF, zo, zc, za, zR, zM, zE and zd */
+static void fold_command(int num_times)
+{
+	struct fold *f;
+	char c;
+	int i, type, top = screen_top();
+
+	if (!read_mapped_key(&c, MAP_NONE)) return;
+	f = fold_holding(cur_line, 0);
+	switch (c) {
+	case 'f':
+		type = get_movement('f', num_times);
+		if (type < 0) return;
+		i = cur_movement.start_line;
+		if (fold_create(i, type ? i + cur_movement.dest_line - 1 : i)) goto error_short;
+		break;
+	case 'F':
+		if (fold_create(cur_line, cur_line + num_times - 1)) goto error_short;
+		break;
+	case 'o':
+	case 'c':
+	case 'a':
+		if (f == NULL) {
+			strcpy(custom_status, "No fold found");
+			return;
+		}
+		if (c == 'a') c = f->closed ? 'o' : 'c';
+		if (f->closed != (c == 'c')) {
+			f->closed = (c == 'c');
+			folds_closed += f->closed ? 1 : -1;
+		}
+		break;
+	case 'R':
+	case 'M':
+		for (i = 0; i < fold_count; i++) folds[i].closed = (c == 'M');
+		folds_closed = (c == 'M') ? fold_count : 0;
+		break;
+	case 'E':
+		fold_count = 0;
+		folds_closed = 0;
+		break;
+	case 'd':
+		if (f == NULL) {
+			strcpy(custom_status, "No fold found");
+			return;
+		}
+		if (f->closed) folds_closed--;
+		i = f - folds;
+		memmove(f, f + 1, sizeof(struct fold) * (fold_count - i - 1));
+		fold_count--;
+		break;
+	default:
+		if (c != '\033') strcpy(custom_status, "Unknown z command");
+		return;
+	}
+	fold_view(top);
+	return;
+
+error_short:
+	strcpy(custom_status, "A fold needs two or more lines");
+	return;
+}
+
+
+/* Move the cursor for motion 'c' in visual mode ('count' is 0 if none
+ * was typed). Returns 0 if 'c' isn't a motion. */
+static int visual_move(char c, int count)
+{
+	const char *text = cur_line_s->text;
+	int len = cur_line_s->len;
+	int pos = crsr_x + line_shift - 1;
+	int n = count ? count : 1;
+	int big = (c >= 'A' && c <= 'Z');
+
+	switch (c) {
+	case 'j':
+		move_lines(n);
+		return 1;
+	case 'k':
+		move_lines(-n);
+		return 1;
+	case 'G':
+		jump_to_line(count ? count : line_count);
+		return 1;
+	case 'h':
+		pos -= n;
+		break;
+	case 'l':
+	case ' ':
+		pos += n;
+		break;
+	case '0':
+		pos = 0;
+		break;
+	case '^':
+		for (pos = 0; pos < len && word_class(text[pos], 1) == 0; pos++);
+		break;
+	case '$':
+		pos = len - 1;
+		break;
+	case 'w':
+	case 'W':
+		while (n-- > 0) pos = word_forward(text, len, pos, big);
+		break;
+	case 'b':
+	case 'B':
+		while (n-- > 0) pos = word_back(text, len, pos, big);
+		break;
+	case 'e':
+	case 'E':
+		while (n-- > 0) pos = word_end(text, len, pos, big, 0);
+		break;
+	default:
+		return 0;
 	}
-	/* Pull the cursor to EOL if it is too far over */
-	if (crsr_x > cur_line_s->len) crsr_x = cur_line_s->len;
-	line_shift = 0;
-	redraw_line(cur_line_s, crsr_y);
+	if (pos > len - 1) pos = len - 1;
+	if (pos < 0) pos = 0;
+	crsr_to_col(pos + 1);
+	return 1;
+}
+
 
+/* Redraw the visible rows whose selection a move from 'old_line' changed */
+static void visual_refresh(int old_line)
+{
+	int top = line_row(cur_line) - crsr_y + 1;
+	int a, b;
+
+	a = (old_line < cur_line) ? old_line : cur_line;
+	b = (old_line > cur_line) ? old_line : cur_line;
+	if (visual_mode == '\026') {
+		/* Every row of a block shares its columns */
+		if (visual_line < a) a = visual_line;
+		if (visual_line > b) b = visual_line;
+	}
+	a = line_row(a);
+	b = line_row(b);
+	if (a < top) a = top;
+	if (b > top + term_rows - 1) b = top + term_rows - 1;
+	if (a <= b) redraw_screen(a - top + 1, b - top + 1);
 	return;
 }
 
 
-static void do_cursor_down(void)
+/* Delete a region in one pass: whole lines for V, the same columns of
+ * every line for a block, or from one position to another for v */
+static void region_delete(const struct region *r)
 {
-	int temp_shift = line_shift;
+	struct line *line, *removed;
+	int n = r->l2 - r->l1 + 1;
+	int i, from, to;
 
-	line_shift = 0;
-	redraw_line(cur_line_s, crsr_y);
-	line_shift = temp_shift;
-	if (cur_line == line_count) return;
-	if (cur_line_s->next == NULL) return;
-	cur_line_s = cur_line_s->next;
-	cur_line++;
-	if (crsr_y < term_rows) crsr_y++;
-//	else redraw_screen(0, 0);
-	else {
-		SCROLL_DOWN();
-		redraw_line(cur_line_s, crsr_y);
+	jump_to_edit(r->l1);
+	if (r->mode == 'V') {
+		delete_lines(n);
+		return;
 	}
-	/* Pull the cursor to EOL if it is too far over */
-	if ((crsr_x + line_shift) > cur_line_s->len) {
-		if (cur_line_s->len <= line_shift)
-			line_shift = cur_line_s->len - 1;
-		crsr_x = cur_line_s->len - line_shift;
-		if (crsr_x == 0) crsr_x = 1;
-		//redraw_screen(0, 0);
-		redraw_line(cur_line_s, crsr_y);
+	undo_begin(r->l1, n);
+	if (r->mode == 'v' && n > 1) {
+		/* Drop the lines in between, then splice the ends together */
+		removed = lines_unlink(r->l1 + 1, n - 2);
+		destroy_buffer(&removed);
+		line = cur_line_s->next;
+		region_span(r, r->l2, line->len, &from, &to);
+		line_cow(line);
+		memmove(line->text, line->text + to, line->len - to + 1);
+		line->len -= to;
+		line_cow(cur_line_s);
+		region_span(r, r->l1, cur_line_s->len, &from, &to);
+		cur_line_s->len = from;
+		cur_line_s->text[from] = '\0';
+		join_lines(r->l1, 2, 0);
+	} else {
+		for (i = 0, line = cur_line_s; i < n; i++, line = line->next) {
+			if (!region_span(r, r->l1 + i, line->len, &from, &to) || from == to)
+				continue;
+			line_cow(line);
+			memmove(line->text + from, line->text + to, line->len - to + 1);
+			line->len -= to - from;
+		}
 	}
-
+	undo_end();
+	redraw_screen(0, 0);
+	crsr_to_col(r->c1 + 1);
 	return;
 }
 
 
-/* Load a file into buffer starting at a particular line */
-int load_file(const char * const restrict name, const int start_line)
+/* Fill the selected bytes of every line of a region with 'arg' (for r)
+ * or change their case ('arg' is the case mode), in one pass */
+static void region_apply(const struct region *r, int fill, int arg)
 {
-	FILE *fp;
-	struct line *cur_load_line;
-	int load_line_count = 0;
-	int buflen;
+	struct line *line;
+	int n = r->l2 - r->l1 + 1;
+	int i, from, to;
 
-	/* start_line = 0 will load at the beginning of the buffer */
-	if ((start_line != 0) && (start_line > line_count)) {
-//		printf("start_line %d, line_count %d, cur_line %d, name %s\n",
-//				start_line, line_count, cur_line, name);
-		return -1;
-	}
-	if (name[0] == '\0') {
-		strcpy(custom_status, "No filename specified to load");
-		return -2;
+	jump_to_edit(r->l1);
+	undo_begin(r->l1, n);
+	for (i = 0, line = cur_line_s; i < n; i++, line = line->next) {
+		if (!region_span(r, r->l1 + i, line->len, &from, &to) || from == to)
+			continue;
+		line_cow(line);
+		if (fill) memset(line->text + from, arg, to - from);
+		else case_convert(line->text + from, to - from, arg);
 	}
+	undo_end();
+	redraw_screen(0, 0);
+	crsr_to_col((r->mode == 'V' ? 0 : r->c1) + 1);
+	return;
+}
 
-	fp = fopen(curfile, "rb");
-	if (!fp) return -3;
-
-	cur_load_line = walk_to_line(start_line, line_head);
-	if (cur_load_line == NULL) cur_load_line = line_head;
-	/* Read the file into the buffer line by line */
-	while (feof(fp) == 0) {
-		//printf("entry: cll %p, lh %p, sl %d, linecnts %d,%d\n",cur_load_line,line_head,start_line,line_count,load_line_count);
-		buf[0] = '\0';
-		if (fgets(buf, CHUNK_SIZE, fp) == NULL) {
-			fclose(fp);
-			break;
-		}
-		if (ferror(fp) != 0) {
-			fclose(fp);
-			return -4;
-		}
 
-		buflen = strlen(buf) - 1;
-		if (buf[buflen] == '\n' || buf[buflen] == '\r') buf[buflen] = '\0';
-		cur_load_line = alloc_new_line(0, buf, &line_count, &cur_load_line); // fast way
-		if (cur_load_line == NULL) {
-			fclose(fp);
-			return -5;
-		}
-		//printf("line %d len %d: %s", line_count, strlen(buf), buf);
-		if (line_head == NULL) {
-			line_head = cur_load_line;
-			line_head->prev = NULL;
+/* Block I and A (and c): type on the first line, then put the same text
+ * into every other line of the block in one pass. A pads short lines
+ * out to the column; I skips them. */
+static void block_insert(const struct region *r, int append)
+{
+	struct line *line;
+	const char *text;
+	int n = r->l2 - r->l1 + 1;
+	int i, pos, pad, len;
+
+	pos = append ? r->c2 + 1 : r->c1;
+	jump_to_edit(r->l1);
+	undo_begin(r->l1, n);
+	if (cur_line_s->len < pos) {
+		line_reserve(cur_line_s, pos);
+		memset(cur_line_s->text + cur_line_s->len, ' ', pos - cur_line_s->len);
+		cur_line_s->len = pos;
+		cur_line_s->text[pos] = '\0';
+	}
+	crsr_to_pos(pos);
+	set_last_change(0, 0, 1);
+	vi_mode = MODE_INSERT;
+	update_status();
+	insert_capture = 1;
+	edit_mode();
+	insert_capture = 0;
+
+	text = last_change.text;
+	len = last_change.text_len;
+	if (len > 0 && memchr(text, '\n', len) == NULL) {
+		line = find_line(r->l1)->next;
+		for (i = 1; i < n && line != NULL; i++, line = line->next) {
+			pad = 0;
+			if (line->len < pos) {
+				if (!append) continue;
+				pad = pos - line->len;
+			}
+			line_reserve(line, line->len + pad + len);
+			memset(line->text + line->len, ' ', pad);
+			line->len += pad;
+			memmove(line->text + pos + len, line->text + pos, line->len - pos + 1);
+			memcpy(line->text + pos, text, len);
+			line->len += len;
 		}
-		load_line_count++;
-		//printf("loop : cll %p, lh %p, sl %d, linecnts %d,%d\n",cur_load_line,line_head,start_line,line_count,load_line_count);
+		redraw_screen(0, 0);
 	}
-
-	//exit(0);
-	return load_line_count;
+	undo_end();
+	last_change.op = 0;
+	return;
 }
 
 
-/* Save the buffer to the file specified */
-int save_file(const char * const restrict name)
+/* Run operator 'op' on the selection; returns 0 if 'op' isn't one */
+static int visual_operate(char op, int count)
 {
-	FILE *fp;
-	struct line *line = line_head;
+	struct region r;
+	int n;
+	char c;
 
-	if (!name || *name == '\0') return -1;
-	/* TODO: save the file */
-	fp = fopen(name, "w+b");
-	if (!fp) return -1;
-	while (line) {
-		errno = 0;
-		fwrite(line->text, line->len, 1, fp);
-		if (ferror(fp)) break;
-		fwrite("\n", 1, 1, fp);
-		if (ferror(fp)) break;
-		line = line->next;
+	visual_region(&r);
+	n = r.l2 - r.l1 + 1;
+	/* Keys that work on whole lines, except that a block's D and C
+	 * run from its left column to the end of each line */
+	if (op == 'X' || op == 'D' || op == 'R' || op == 'S' || op == 'C') {
+		if (r.mode != '\026' || op == 'X' || op == 'R' || op == 'S') r.mode = 'V';
+		else r.c2 = INT_MAX - 1;
+		op = (op == 'X' || op == 'D') ? 'd' : 'c';
+	}
+	switch (op) {
+	case 'd':
+	case 'x':
+		visual_mode = 0;
+		region_delete(&r);
+		if (r.mode == 'V') set_last_change('d', 'd', n);
+		return 1;
+	case 'c':
+	case 's':
+		visual_mode = 0;
+		jump_to_edit(r.l1);
+		if (r.mode == 'V') {
+			cur_movement.start_line = r.l1;
+			cur_movement.dest_line = n;
+			cur_movement.motion = 'c';
+			cur_movement.motion_arg = 0;
+			cur_movement.count = n;
+			change_text(1);
+		} else if (r.mode == '\026') {
+			undo_begin(r.l1, n);
+			region_delete(&r);
+			block_insert(&r, 0);
+			undo_end();
+		} else if (n == 1) {
+			region_span(&r, r.l1, cur_line_s->len, &cur_movement.start_char,
+					&cur_movement.dest_char);
+			cur_movement.count = cur_movement.dest_char - cur_movement.start_char;
+			cur_movement.start_char++;
+			cur_movement.dest_char++;
+			cur_movement.motion = 'l';
+			cur_movement.motion_arg = 0;
+			change_text(0);
+		} else {
+			undo_begin(r.l1, n);
+			region_delete(&r);
+			crsr_to_pos(r.c1);
+			set_last_change(0, 0, 1);
+			vi_mode = MODE_INSERT;
+			update_status();
+			edit_mode();
+			undo_end();
+		}
+		return 1;
+	case 'I':
+	case 'A':
+		if (r.mode != '\026') return 0;
+		visual_mode = 0;
+		block_insert(&r, op == 'A');
+		return 1;
+	case 'r':
+		if (!read_mapped_key(&c, MAP_NONE) || c == '\033') return 1;
+		visual_mode = 0;
+		region_apply(&r, 1, c);
+		return 1;
+	case '~':
+	case 'U':
+	case 'u':
+		visual_mode = 0;
+		region_apply(&r, 0, op == 'U' ? CASE_UPPER : (op == 'u' ? CASE_LOWER : CASE_TOGGLE));
+		return 1;
+	case '>':
+	case '<':
+		visual_mode = 0;
+		shift_lines(r.l1, n, op == '>' ? 1 : -1, count ? count : 1);
+		return 1;
+	case 'J':
+		visual_mode = 0;
+		crsr_to_col(join_lines(r.l1, n, 1) + 1);
+		return 1;
+	case 'z':
+		if (!read_mapped_key(&c, MAP_NONE) || c != 'f') return 1;
+		visual_mode = 0;
+		n = screen_top();
+		fold_create(r.l1, r.l2);
+		fold_view(n);
+		return 1;
 	}
-	fclose(fp);
-	if (errno != 0) return -1;
 	return 0;
 }
 
 
-/* Get a movement subcommand
- * Returns 0 on valid movement, -1 on invalid movement or ESC
- * Returns 1 on invalid movement to allow 'dd' 'yy' etc. to work */
-int get_movement(char *command, int cmd_len, int num_times)
+/* v, V and Ctrl-V: select with motions, then run an operator on it */
+static void visual_select(char mode)
 {
 	char c;
+	int count, old_line, pos;
 
-	while (read(STDIN_FILENO, &c, 1)) {
-		/* Handle numbers first */
-		if (c >= '1' && c <= '9') {
+	visual_mode = mode;
+	visual_line = cur_line;
+	visual_col = crsr_x + line_shift - 1;
+	redraw_line(cur_line_s, crsr_y);
+	while (visual_mode) {
+		snprintf(custom_status, MAX_STATUS, "-- VISUAL%s --",
+				visual_mode == 'V' ? " LINE"
+				: (visual_mode == '\026' ? " BLOCK" : ""));
+		update_status();
+		crsr_restore();
+		if (!read_mapped_key(&c, MAP_NONE)) break;
+		count = 0;
+		while ((c >= '1' && c <= '9') || (c == '0' && count > 0)) {
+			count = count * 10 + c - '0';
+			if (!read_mapped_key(&c, MAP_NONE)) break;
 		}
-		switch(c) {
-		case '\033':
-		case '\027':
-			return -1;
-		case 'h':	/* left */
-		case 'j':	/* down */
-		case 'k':	/* up */
-		case 'l':	/* right */
-		case 'H':	/* top of screen */
-		case 'M':	/* middle of screen */
-		case 'L':	/* bottom of screen */
-		case 'w':	/* next word */
-		case 'W':	/* previous word */
-		case 'b':	/* beginning of word */
-		case 'B':	/* beginning of blank-delimited word */
-		case 'e':	/* end of word */
-		case 'E':	/* end of blank-delimited word */
-		case '(':	/* one sentence back */
-		case ')':	/* one sentence forward */
-		case '{':	/* one paragraph back */
-		case '}':	/* one paragraph forward */
-		case '0':	/* beginning of line */
-		case '$':	/* end of line */
-		case 'G':	/* last line of file */
-		case ':':	/* move to :n line of file */
-		case 'f':	/* fc: move forward to char 'c' */
-		case 'F':	/* Fc: move backward to char 'c' */
-		case '%':	/* move to associated (), {}, or [] */
-		default:
-			return 1;
+		if (c == '\033' || c == visual_mode) break;
+		if (c == 'v' || c == 'V' || c == '\026') {
+			visual_mode = c;
+			redraw_screen(0, 0);
+			continue;
+		}
+		old_line = cur_line;
+		if (c == 'o') {
+			/* Swap the cursor and the anchor */
+			pos = crsr_x + line_shift - 1;
+			jump_to_line(visual_line);
+			crsr_to_col(visual_col + 1);
+			visual_line = old_line;
+			visual_col = pos;
+			visual_refresh(old_line);
+			continue;
+		}
+		if (visual_move(c, count)) {
+			visual_refresh(old_line);
+			continue;
 		}
+		*custom_status = '\0';
+		if (visual_operate(c, count)) return;
 	}
-	return 0;
+	visual_mode = 0;
+	*custom_status = '\0';
+	redraw_screen(0, 0);
+	return;
 }
 
+
 /* Handle an incoming command */
-int do_cmd(char c)
+static int do_cmd(char c)
 {
 	char command[MAX_CMDSIZE];
-	char *savefile;
+	char *savefile, *ex_cmd;
+	struct mark saved_mark;
 	int cmd_len = 0;
 	int num_times = 1;
+	int first, last;
 	int i;
 
 	command[0] = c; cmd_len++;
@@ -1052,13 +6097,28 @@ int do_cmd(char c)
 	while (c >= '0' && c <= '9') {
 		strncpy(custom_status, command, cmd_len + 1);
 		update_status();
-		read(STDIN_FILENO, &c, 1);
+		if (!read_mapped_key(&c, MAP_NORMAL)) goto end_cmd;
 		command[cmd_len] = c; cmd_len++;
 		if (cmd_len == MAX_CMDSIZE - 1) break;
 	}
 
 	/* User pressed ESC; cancel command */
 	if (c == '\033') goto end_cmd;
+	/* Ctrl-O and Ctrl-I (Tab): older and newer jump list positions */
+	if (c == '\017' || c == '\t') {
+		jump_older(c == '\t' ? 1 : -1, num_times);
+		goto end_cmd;
+	}
+	/* Ctrl-V: block visual mode */
+	if (c == '\026') {
+		visual_select(c);
+		goto end_cmd;
+	}
+	/* Ctrl-R: redo */
+	if (c == '\022') {
+		if (undo(1)) strcpy(custom_status, "Already at newest change");
+		goto end_cmd;
+	}
 	/* ignore other control codes */
 	if (c < 32 || c > 127) goto end_cmd;
 
@@ -1077,76 +6137,140 @@ int do_cmd(char c)
 	case '#': SCROLL_DOWN(); break;
 	case 'd':
 		/* TODO: Replace with yank + delete in the movement section */
-		read(STDIN_FILENO, &c, 1);
-		if (c == '\033') goto end_cmd;
+		if (!read_key(&c) || c == '\033') goto end_cmd;
 		if (c == 'd') {
-			for (i = num_times; i > 0; i--) {
-				if (cur_line == line_count) {
-					/* Last/only line is a special case */
-					if (cur_line > 1) {
-						do_cursor_up();
-						destroy_line(cur_line_s->next);
-						break;
-					} else {
-						destroy_line(cur_line_s);
-						crsr_x = 0; line_shift = 0;
-						crsr_restore();
-						break;
-					}
-				} else {
-					cur_line_s = cur_line_s->next;
-					destroy_line(cur_line_s->prev);
-				}
-			}
-			if (i < num_times) sprintf(custom_status, "Deleted %d lines at %d",
-					num_times - i, cur_line);
+			delete_lines(num_times);
+			set_last_change('d', 'd', num_times);
 		}
 		break;
 	case 'a':	/* append insert */
 		/* Append is insert with the cursor moved right */
 		vi_mode = MODE_INSERT;
 		do_cursor_right();
+		/* fall through */
 	case 'i':	/* insert */
-		vi_mode = MODE_INSERT;
-		update_status();
-		edit_mode();
+		undo_begin(cur_line, 1);
+		insert_mode(command[cmd_len - 1], num_times);
+		undo_end();
+		break;
+	case 'c':	/* change */
+		change_text(get_movement('c', num_times));
+		break;
+	case 'C':	/* change to end of line */
+		change_text(set_movement('c', '$', 0, 1));
+		break;
+	case 's':	/* substitute characters */
+		change_text(set_movement('c', 'l', 0, num_times));
+		break;
+	case 'S':	/* substitute lines */
+		change_text(set_movement('c', 'c', 0, num_times));
+		break;
+	case '>':	/* shift right */
+	case '<':	/* shift left */
+		shift_motion(command[cmd_len - 1], num_times);
+		break;
+	case 'm':	/* set a mark */
+		if (!read_mapped_key(&c, MAP_NONE)) goto end_cmd;
+		if (c >= 'a' && c <= 'z') mark_here(&marks[c - 'a']);
+		else if (c != '\033') strcpy(custom_status, "Marks are a-z");
+		break;
+	case '\'':	/* go to a mark's line */
+	case '`':	/* go to a mark's position */
+		if (!read_mapped_key(&c, MAP_NONE) || c == '\033') goto end_cmd;
+		if (c == '\'' || c == '`') {
+			/* Back to before the latest jump */
+			saved_mark = mark_prev;
+			jump_push();
+			mark_goto(&saved_mark, command[cmd_len - 1] == '`');
+		} else if (c >= 'a' && c <= 'z') {
+			if (line_number(marks[c - 'a'].line) != 0) jump_push();
+			mark_goto(&marks[c - 'a'], command[cmd_len - 1] == '`');
+		} else strcpy(custom_status, "Marks are a-z");
+		break;
+	case 'G':	/* go to line (default last) */
+		jump_push();
+		jump_to_line((*command >= '1' && *command <= '9') ? num_times : line_count);
+		break;
+	case 'v':	/* visual mode */
+	case 'V':	/* visual line mode */
+		visual_select(command[cmd_len - 1]);
+		break;
+	case '~':	/* toggle case */
+		toggle_case(num_times);
+		set_last_change('~', 0, num_times);
+		break;
+	case 'g':	/* gU, gu, g~ */
+		case_motion(num_times);
+		break;
+	case 'z':	/* folds */
+		fold_command(num_times);
+		break;
+	case 'J':	/* join lines */
+		crsr_to_col(join_lines(cur_line, num_times, 1) + 1);
+		set_last_change('J', 0, num_times);
+		break;
+	case 'r':	/* replace characters */
+		if (!read_key(&c) || c == '\033') goto end_cmd;
+		if (!replace_chars(c, num_times)) set_last_change('r', c, num_times);
+		break;
+	case 'R':	/* replace mode */
+		undo_begin(cur_line, 1);
+		replace_mode(num_times);
+		undo_end();
 		break;
 	case 'h':	/* left */
-		do_cursor_left();
+		if (num_times == 1) do_cursor_left();
+		else crsr_to_col(crsr_x + line_shift - num_times);
 		break;
 	case 'j':	/* down */
-		do_cursor_down();
+		move_lines(num_times);
 		break;
 	case 'k':	/* up */
-		do_cursor_up();
+		move_lines(-num_times);
 		break;
 	case 'l':	/* right */
-		do_cursor_right();
+		if (num_times == 1) do_cursor_right();
+		else crsr_to_col(crsr_x + line_shift + num_times);
+		break;
+	case 'n':	/* repeat last search */
+		do_search(search_pattern);
 		break;
 	case 'o':
+		undo_begin(cur_line + 1, 0);
 		if(alloc_new_line(cur_line, NULL, &line_count, &line_head) == NULL) oom();
 		go_to_start_of_next_line();
 		redraw_screen(crsr_y, 0);
-		vi_mode = MODE_INSERT;
-		update_status();
-		edit_mode();
+		insert_mode('o', num_times);
+		undo_end();
 		break;
 	case 'p':
 		sprintf(custom_status, "'put' command not yet supported");
 		break;
-	case 'x':	/* Delete char at cursor */
-		i = num_times;
-		for (i = num_times; i > 0; i--) {
-			if (do_del_under_crsr(0) == 1) break;
-		}
+	case 'q':	/* record a macro */
+		if (macro_recording >= 0) macro_record(0);
+		else if (read_key(&c)) macro_record(c);
+		break;
+	case '@':	/* replay a macro */
+		if (read_key(&c)) macro_play(c, num_times);
 		break;
+	case 'u':	/* undo */
+		if (undo(0)) strcpy(custom_status, "Already at oldest change");
+		break;
+	case 'x':	/* Delete char at cursor */
 	case 'X':	/* Delete char left of cursor */
-		i = num_times;
-		for (i = num_times; i > 0; i--) {
-			if (crsr_x == 1) break;
-			crsr_x--;
-			if (do_del_under_crsr(1) == 1) break;
-		}
+		delete_chars(num_times, command[cmd_len - 1] == 'X');
+		set_last_change(command[cmd_len - 1], 0, num_times);
+		break;
+	case '.':	/* repeat last change */
+		repeat_change((command[0] >= '1' && command[0] <= '9') ? num_times : 0);
+		break;
+	case '/':	/* search forward */
+		crsr_yx(term_real_rows, 1);
+		ERASE_LINE();
+		term_write("/", 1);
+		cmd_len = get_command_string(command);
+		if (cmd_len > 0) strcpy(search_pattern, command);
+		do_search(search_pattern);
 		break;
 #ifndef __ELKS__
 	case '!':	/* NON-STANDARD cursor pos dump */
@@ -1162,9 +6286,27 @@ int do_cmd(char c)
 	case ':':	/* Colon command */
 		crsr_yx(term_real_rows, 1);
 		ERASE_LINE();
-		write(STDOUT_FILENO, ":", 1);
+		term_write(":", 1);
 		cmd_len = get_command_string(command);
 		if (!cmd_len) break;
+		ex_cmd = parse_range(command, &first, &last);
+		if (ex_cmd == NULL) {
+			strcpy(custom_status, "Invalid range");
+			goto end_cmd;
+		}
+		if (ex_join(ex_cmd, first, last)) goto end_cmd;
+		if (ex_shift(ex_cmd, first, last)) goto end_cmd;
+		if (ex_fold(ex_cmd, first, last)) goto end_cmd;
+		if (ex_compact(ex_cmd, ex_cmd != command, first, last)) goto end_cmd;
+		if (ex_cmd != command) {
+			/* A bare address moves to that line */
+			if (*ex_cmd == '\0') {
+				jump_push();
+				jump_to_line(last);
+			}
+			else strcpy(custom_status, "Command doesn't take a range");
+			goto end_cmd;
+		}
 		if (strncmp(command, "wq", 2) == 0) {
 			/* Save to current file */
 			if (cmd_len == 2 && *curfile != '\0') {
@@ -1186,7 +6328,30 @@ int do_cmd(char c)
 				if (*curfile != 0) i = save_file(curfile);
 				else sprintf(custom_status, "Cannot save: no file name specified");
 			} else i = save_file(savefile);
-			if (i) sprintf(custom_status, "Error while saving file");
+			if (i && *custom_status == '\0')
+				sprintf(custom_status, "Error while saving file");
+			goto end_cmd;
+		}
+		if (ex_setting_command(command)) goto end_cmd;
+		if (strcmp(command, "stats") == 0) {
+			stats_show();
+			goto end_cmd;
+		}
+		if (strcmp(command, "latency") == 0) {
+			latency_show();
+			goto end_cmd;
+		}
+		if (strcmp(command, "mem") == 0) {
+			mem_show();
+			goto end_cmd;
+		}
+		if (strcmp(command, "trace") == 0) {
+#ifdef VI_TRACE
+			if (trace_dump()) strcpy(custom_status, "Cannot write debug.log");
+			else strcpy(custom_status, "Trace written to debug.log");
+#else
+			strcpy(custom_status, "Tracing not built in (-DVI_TRACE)");
+#endif	/* VI_TRACE */
 			goto end_cmd;
 		}
 		if (strcmp(command, "q") == 0) goto end_vi;
@@ -1208,15 +6373,242 @@ end_vi:
 	crsr_yx(term_real_rows, 1);
 	ERASE_LINE();
 	term_restore();
+	session_close();
+	stats_dump();
+	latency_dump();
+	pool_shutdown();
 	destroy_buffer(&line_head);
 	destroy_buffer(&yank_head);
 	exit(EXIT_SUCCESS);
 }
 
 
-int main(int argc, char **argv)
+#ifdef VEE_LIB
+/* libvee: the buffer engine behind an explicit buffer object
+ * The engine works on one set of globals, so each buffer keeps its
+ * own copy of everything that belongs to a file (the lines, cursor,
+ * marks, folds and undo history) and vee_select() swaps it in. The
+ * yank buffer, last search and last change stay shared, as they are
+ * between files in the editor. Nothing is drawn: the screen size is
+ * only used for cursor arithmetic. */
+struct vee_buffer {
+	struct line *line_head;
+	struct line *cur_line_s;
+	int line_count;
+	int cur_line, crsr_x, crsr_y, line_shift;
+	char curfile[PATH_MAX];
+	struct mark marks[26];
+	struct mark mark_prev;
+	struct mark jump_list[JUMP_MAX];
+	int jump_len, jump_pos, marks_used;
+	struct fold *folds;
+	int fold_count, fold_alloc, folds_closed;
+	struct undo_rec *undo_list;
+	struct undo_rec *redo_list;
+};
+static struct vee_buffer *vee_current = NULL;
+
+/* Move the current buffer's state between the globals and 'b' */
+static void vee_swap(struct vee_buffer *b, int save)
+{
+#define VEE_SWAP(field) do { if (save) b->field = field; else field = b->field; } while (0)
+	VEE_SWAP(line_head);
+	VEE_SWAP(cur_line_s);
+	VEE_SWAP(line_count);
+	VEE_SWAP(cur_line);
+	VEE_SWAP(crsr_x);
+	VEE_SWAP(crsr_y);
+	VEE_SWAP(line_shift);
+	VEE_SWAP(mark_prev);
+	VEE_SWAP(jump_len);
+	VEE_SWAP(jump_pos);
+	VEE_SWAP(marks_used);
+	VEE_SWAP(folds);
+	VEE_SWAP(fold_count);
+	VEE_SWAP(fold_alloc);
+	VEE_SWAP(folds_closed);
+	VEE_SWAP(undo_list);
+	VEE_SWAP(redo_list);
+#undef VEE_SWAP
+	if (save) {
+		memcpy(b->curfile, curfile, sizeof(curfile));
+		memcpy(b->marks, marks, sizeof(marks));
+		memcpy(b->jump_list, jump_list, sizeof(jump_list));
+	} else {
+		memcpy(curfile, b->curfile, sizeof(curfile));
+		memcpy(marks, b->marks, sizeof(marks));
+		memcpy(jump_list, b->jump_list, sizeof(jump_list));
+	}
+	return;
+}
+
+
+static void vee_select(struct vee_buffer *b)
+{
+	render_suppressed = 1;
+	if (term_rows < 1) {
+		term_real_rows = 24;
+		term_rows = 23;
+		term_cols = 80;
+	}
+	if (vee_current == b) return;
+	if (vee_current != NULL) vee_swap(vee_current, 1);
+	vee_swap(b, 0);
+	vee_current = b;
+	return;
+}
+
+
+/* Put the cursor on line 'num', column 'col'; -1 if there's no such
+ * position (the column just past the end of the line is one) */
+static int vee_goto(int num, int col)
+{
+	struct line *line = find_line(num);
+
+	if (line == NULL || col < 0 || col > line->len) return -1;
+	cur_line_s = line;
+	cur_line = num;
+	crsr_y = 1;
+	line_shift = 0;
+	crsr_x = col + 1;
+	return 0;
+}
+
+
+struct vee_buffer *vee_open(const char *path)
 {
+	struct vee_buffer *b;
 	int i;
+
+	b = (struct vee_buffer *)vi_calloc(MEM_MISC, 1, sizeof(struct vee_buffer));
+	if (b == NULL) return NULL;
+	vee_select(b);
+	if (path != NULL) strncpy(curfile, path, PATH_MAX - 1);
+	if (*curfile != '\0') {
+		i = load_file(curfile, 0);
+		if (i < 0 && i != -3) {
+			vee_close(b);
+			return NULL;
+		}
+	}
+	/* A buffer always has at least one line */
+	if (line_head == NULL && alloc_new_line(0, NULL, &line_count, &line_head) == NULL) {
+		vee_close(b);
+		return NULL;
+	}
+	cur_line_s = line_head;
+	cur_line = 1;
+	crsr_x = 1;
+	crsr_y = 1;
+	return b;
+}
+
+
+void vee_close(struct vee_buffer *b)
+{
+	if (b == NULL) return;
+	vee_select(b);
+	undo_free_list(&undo_list);
+	undo_free_list(&redo_list);
+	destroy_buffer(&line_head);
+	vi_free(MEM_FOLD, folds, fold_alloc * sizeof(struct fold));
+	folds = NULL;
+	fold_count = fold_alloc = folds_closed = 0;
+	line_count = 0;
+	cur_line_s = NULL;
+	vee_current = NULL;
+	vi_free(MEM_MISC, b, sizeof(struct vee_buffer));
+	snap_reclaim();
+	return;
+}
+
+
+int vee_save(struct vee_buffer *b, const char *path)
+{
+	vee_select(b);
+	return save_file(path != NULL ? path : curfile) == 0 ? 0 : -1;
+}
+
+
+int vee_line_count(struct vee_buffer *b)
+{
+	vee_select(b);
+	return line_count;
+}
+
+
+const char *vee_line(struct vee_buffer *b, int num, int *len)
+{
+	vee_select(b);
+	/* The cursor follows, so the next line is one step away */
+	if (vee_goto(num, 0) != 0) return NULL;
+	if (len != NULL) *len = cur_line_s->len;
+	return cur_line_s->text;
+}
+
+
+int vee_insert(struct vee_buffer *b, int line, int col, const char *text, int len)
+{
+	vee_select(b);
+	if (vee_goto(line, col) != 0) return -1;
+	undo_begin(cur_line, 1);
+	insert_text(text, len, 1, crsr_x - 1);
+	undo_end();
+	return 0;
+}
+
+
+int vee_delete(struct vee_buffer *b, int line, int col, int count)
+{
+	vee_select(b);
+	if (count <= 0 || vee_goto(line, col) != 0) return -1;
+	delete_chars(count, 0);
+	return 0;
+}
+
+
+int vee_delete_lines(struct vee_buffer *b, int line, int count)
+{
+	vee_select(b);
+	if (count <= 0 || vee_goto(line, 0) != 0) return -1;
+	delete_lines(count);
+	return 0;
+}
+
+
+int vee_undo(struct vee_buffer *b)
+{
+	vee_select(b);
+	return undo(0) ? -1 : 0;
+}
+
+
+int vee_redo(struct vee_buffer *b)
+{
+	vee_select(b);
+	return undo(1) ? -1 : 0;
+}
+
+
+int vee_search(struct vee_buffer *b, const char *pattern, int *line, int *col)
+{
+	vee_select(b);
+	if (vee_goto(*line, *col) != 0) return -1;
+	if (do_search(pattern) != 0) return -1;
+	*line = cur_line;
+	*col = crsr_x + line_shift - 1;
+	return 0;
+}
+#endif	/* VEE_LIB */
+
+
+#ifdef VEE_LIB
+int vee_main(int argc, char **argv)
+#else
+int main(int argc, char **argv)
+#endif	/* VEE_LIB */
+{
+	int i, exrc_errors;
 	char c;
 #ifndef NO_SIGNALS
 	struct sigaction act;
@@ -1227,8 +6619,20 @@ int main(int argc, char **argv)
 	act.sa_sigaction = sigwinch_handler;
 	act.sa_flags = SA_SIGINFO;
 	sigaction(SIGWINCH, &act, NULL);
+
+	/* Ctrl-C cancels long operations */
+	memset(&act, 0, sizeof(struct sigaction));
+	sigemptyset(&act.sa_mask);
+	act.sa_handler = sigint_handler;
+	sigaction(SIGINT, &act, NULL);
 #endif	/* NO_SIGNALS */
 
+	/* Startup script; VI_WORKERS still overrides it */
+	exrc_errors = exrc_load();
+
+	/* Worker thread count for heavy operations (0 = no threads) */
+	if (getenv("VI_WORKERS") != NULL) pool_workers = atoi(getenv("VI_WORKERS"));
+
 	/* Start an empty buffer or load a specified file */
 	cur_line = 1;
 	if (argc == 1) {
@@ -1240,7 +6644,9 @@ int main(int argc, char **argv)
 		}
 	} else {
 		strncpy(curfile, argv[1], PATH_MAX);
+		TRACE_BEGIN("load");
 		i = load_file(curfile, 0);
+		TRACE_END("load");
 		if (i == -3) {
 			cur_line_s = alloc_new_line(line_count, NULL, &line_count, &line_head);
 			if (!cur_line_s) {
@@ -1253,18 +6659,32 @@ int main(int argc, char **argv)
 				fprintf(stderr, "Cannot load %s (error %d)\n", curfile, i);
 				exit(EXIT_FAILURE);
 			}
+			/* An empty file still needs one (empty) line */
+			if (line_head == NULL) alloc_new_line(0, NULL, &line_count, &line_head);
+			if (line_head == NULL) {
+				fprintf(stderr, "Cannot create initial line\n");
+				clean_abort();
+			}
 			cur_line_s = line_head;
 			sprintf(custom_status, "Read %d lines from '%s'", i, curfile);
 		}
 	}
+	if (exrc_errors) snprintf(custom_status, MAX_STATUS,
+			"%d error(s) in %s", exrc_errors,
+			getenv("EXINIT") != NULL ? "EXINIT" : ".exrc");
 
-	/* Initialize the terminal */
-	if ((i = term_init()) != 0) {
+	/* Initialize the terminal, or replay a recorded session without one */
+	if (session_replay_open() != 0) {
+		fprintf(stderr, "cannot replay %s\n", getenv("VI_REPLAY"));
+		clean_abort();
+	}
+	if (session_play == NULL && (i = term_init()) != 0) {
 		if (i == -ENOTTY) fprintf(stderr, "a tty is required\n");
 		else fprintf(stderr, "cannot init terminal: %s\n", strerror(-i));
 		clean_abort();
 	}
 	read_term_dimensions();
+	session_record_open();
 	CLEAR_SCREEN();
 
 	/* Initialize the cursor position and draw the screen */
@@ -1273,6 +6693,21 @@ int main(int argc, char **argv)
 	update_status();
 
 	/* Read commands forever */
-	while (read(STDIN_FILENO, &c, 1)) do_cmd(c);
+	while (read_mapped_key(&c, MAP_NORMAL)) {
+		TRACE_BEGIN("key");
+		do_cmd(c);
+		snap_reclaim();
+		TRACE_END("key");
+	}
+	/* A replay that runs out of keys ends as :q! would */
+	if (session_play != NULL) {
+		term_restore();
+		session_close();
+		stats_dump();
+		latency_dump();
+		pool_shutdown();
+		return EXIT_SUCCESS;
+	}
 	clean_abort();
+	return EXIT_FAILURE;
 }
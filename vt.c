@@ -0,0 +1,344 @@
+/*
+ * Virtual VT100 screen model for vee-eye's test and benchmark drivers
+ * See vt.h for what is covered.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "vt.h"
+
+/* Parser states */
+#define VT_GROUND 0
+#define VT_ESC 1
+#define VT_CSI 2
+#define VT_CHARSET 3	/* ESC ( and friends take one more byte */
+
+
+/* Blank the cells from (row, from) to (row, to - 1) */
+static void vt_clear(struct vt *vt, int row, int from, int to)
+{
+	struct vt_cell *cell = vt->cells + row * vt->cols;
+
+	for (; from < to; from++) {
+		cell[from].c = ' ';
+		cell[from].attr = 0;
+	}
+	return;
+}
+
+
+/* Scroll the region up (dir > 0) or down (dir < 0) by one line */
+static void vt_scroll(struct vt *vt, int dir)
+{
+	struct vt_cell *top = vt->cells + vt->top * vt->cols;
+	int span = vt->bottom - vt->top;
+
+	vt->count.scrolls++;
+	if (span > 0) {
+		if (dir > 0) memmove(top, top + vt->cols, span * vt->cols * sizeof(struct vt_cell));
+		else memmove(top + vt->cols, top, span * vt->cols * sizeof(struct vt_cell));
+	}
+	vt_clear(vt, dir > 0 ? vt->bottom : vt->top, 0, vt->cols);
+	return;
+}
+
+
+/* Move down a line, scrolling at the bottom of the region */
+static void vt_linefeed(struct vt *vt)
+{
+	vt->wrap_pending = 0;
+	if (vt->row == vt->bottom) vt_scroll(vt, 1);
+	else if (vt->row < vt->rows - 1) vt->row++;
+	return;
+}
+
+
+static void vt_goto(struct vt *vt, int row, int col)
+{
+	if (row < 0) row = 0;
+	if (row >= vt->rows) row = vt->rows - 1;
+	if (col < 0) col = 0;
+	if (col >= vt->cols) col = vt->cols - 1;
+	vt->row = row;
+	vt->col = col;
+	vt->wrap_pending = 0;
+	return;
+}
+
+
+/* Put one character at the cursor */
+static void vt_put(struct vt *vt, char c)
+{
+	struct vt_cell *cell;
+
+	vt->count.text++;
+	if (vt->wrap_pending) {
+		vt->col = 0;
+		vt_linefeed(vt);
+	}
+	cell = vt->cells + vt->row * vt->cols + vt->col;
+	cell->c = c;
+	cell->attr = vt->attr;
+	if (vt->col < vt->cols - 1) vt->col++;
+	else if (vt->autowrap) vt->wrap_pending = 1;
+	return;
+}
+
+
+/* Parameter 'i' of the current sequence, or 'def' if it's missing or 0 */
+static int vt_param(const struct vt *vt, int i, int def)
+{
+	if (i >= vt->param_count || vt->params[i] == 0) return def;
+	return vt->params[i];
+}
+
+
+static void vt_sgr(struct vt *vt)
+{
+	int i;
+
+	vt->count.sgr++;
+	if (vt->param_count == 0) vt->attr = 0;
+	for (i = 0; i < vt->param_count; i++) {
+		switch (vt->params[i]) {
+		case 0: vt->attr = 0; break;
+		case 1: vt->attr |= VT_BOLD; break;
+		case 4: vt->attr |= VT_UNDERLINE; break;
+		case 7: vt->attr |= VT_REVERSE; break;
+		case 22: vt->attr &= ~VT_BOLD; break;
+		case 24: vt->attr &= ~VT_UNDERLINE; break;
+		case 27: vt->attr &= ~VT_REVERSE; break;
+		default: break;
+		}
+	}
+	return;
+}
+
+
+/* Carry out a complete CSI sequence */
+static void vt_csi(struct vt *vt, char final)
+{
+	int n = vt_param(vt, 0, 1);
+	int i;
+
+	switch (final) {
+	case 'H':	/* CUP */
+	case 'f':	/* HVP */
+		vt->count.cup++;
+		vt_goto(vt, vt_param(vt, 0, 1) - 1, vt_param(vt, 1, 1) - 1);
+		break;
+	case 'A': vt->count.moves++; vt_goto(vt, vt->row - n, vt->col); break;
+	case 'B': vt->count.moves++; vt_goto(vt, vt->row + n, vt->col); break;
+	case 'C': vt->count.moves++; vt_goto(vt, vt->row, vt->col + n); break;
+	case 'D': vt->count.moves++; vt_goto(vt, vt->row, vt->col - n); break;
+	case 'K':	/* EL */
+		vt->count.el++;
+		switch (vt_param(vt, 0, 0)) {
+		case 0: vt_clear(vt, vt->row, vt->col, vt->cols); break;
+		case 1: vt_clear(vt, vt->row, 0, vt->col + 1); break;
+		case 2: vt_clear(vt, vt->row, 0, vt->cols); break;
+		}
+		break;
+	case 'J':	/* ED */
+		vt->count.ed++;
+		switch (vt_param(vt, 0, 0)) {
+		case 0:
+			vt_clear(vt, vt->row, vt->col, vt->cols);
+			for (i = vt->row + 1; i < vt->rows; i++) vt_clear(vt, i, 0, vt->cols);
+			break;
+		case 1:
+			for (i = 0; i < vt->row; i++) vt_clear(vt, i, 0, vt->cols);
+			vt_clear(vt, vt->row, 0, vt->col + 1);
+			break;
+		case 2:
+			for (i = 0; i < vt->rows; i++) vt_clear(vt, i, 0, vt->cols);
+			break;
+		}
+		break;
+	case 'r':	/* DECSTBM; the cursor goes home */
+		vt->count.stbm++;
+		vt->top = vt_param(vt, 0, 1) - 1;
+		vt->bottom = vt_param(vt, 1, vt->rows) - 1;
+		if (vt->bottom >= vt->rows) vt->bottom = vt->rows - 1;
+		if (vt->top >= vt->bottom) {
+			vt->top = 0;
+			vt->bottom = vt->rows - 1;
+		}
+		vt_goto(vt, 0, 0);
+		break;
+	case 'm':
+		vt_sgr(vt);
+		break;
+	case 'h':	/* SM/RM: only autowrap (7) matters to the grid */
+	case 'l':
+		vt->count.modes++;
+		for (i = 0; i < vt->param_count; i++)
+			if (vt->params[i] == 7) vt->autowrap = (final == 'h');
+		if (!vt->autowrap) vt->wrap_pending = 0;
+		break;
+	default:
+		vt->count.unknown++;
+		break;
+	}
+	return;
+}
+
+
+/* Carry out ESC followed by one byte */
+static void vt_esc(struct vt *vt, char c)
+{
+	vt->state = VT_GROUND;
+	switch (c) {
+	case '[':
+		vt->state = VT_CSI;
+		vt->private = 0;
+		vt->param_count = 0;
+		memset(vt->params, 0, sizeof(vt->params));
+		break;
+	case 'D':	/* IND */
+		vt_linefeed(vt);
+		break;
+	case 'E':	/* NEL */
+		vt->col = 0;
+		vt_linefeed(vt);
+		break;
+	case 'M':	/* RI */
+		vt->wrap_pending = 0;
+		if (vt->row == vt->top) vt_scroll(vt, -1);
+		else if (vt->row > 0) vt->row--;
+		break;
+	case '7':
+		vt->saved_row = vt->row;
+		vt->saved_col = vt->col;
+		break;
+	case '8':
+		vt_goto(vt, vt->saved_row, vt->saved_col);
+		break;
+	case '(': case ')': case '#':
+		vt->state = VT_CHARSET;
+		break;
+	default:
+		vt->count.unknown++;
+		break;
+	}
+	return;
+}
+
+
+/* Set up an empty screen; returns -1 if out of memory */
+int vt_init(struct vt *vt, int rows, int cols)
+{
+	int i;
+
+	memset(vt, 0, sizeof(struct vt));
+	vt->cells = (struct vt_cell *)malloc(rows * cols * sizeof(struct vt_cell));
+	if (vt->cells == NULL) return -1;
+	vt->rows = rows;
+	vt->cols = cols;
+	vt->bottom = rows - 1;
+	vt->autowrap = 1;
+	for (i = 0; i < rows; i++) vt_clear(vt, i, 0, cols);
+	return 0;
+}
+
+
+void vt_free(struct vt *vt)
+{
+	free(vt->cells);
+	vt->cells = NULL;
+	return;
+}
+
+
+/* Apply terminal output to the screen */
+void vt_feed(struct vt *vt, const char *data, long len)
+{
+	int *p;
+	char c;
+
+	vt->count.bytes += len;
+	for (; len > 0; data++, len--) {
+		c = *data;
+		switch (vt->state) {
+		case VT_ESC:
+			vt_esc(vt, c);
+			continue;
+		case VT_CHARSET:
+			vt->state = VT_GROUND;
+			continue;
+		case VT_CSI:
+			if (c >= '0' && c <= '9') {
+				if (vt->param_count == 0) vt->param_count = 1;
+				p = &vt->params[vt->param_count - 1];
+				if (*p < 100000) *p = *p * 10 + (c - '0');
+			} else if (c == ';') {
+				if (vt->param_count == 0) vt->param_count = 1;
+				if (vt->param_count < VT_MAX_PARAMS) vt->param_count++;
+			} else if (c >= 0x3c && c <= 0x3f) {
+				vt->private = c;
+			} else if (c >= 0x40 && c <= 0x7e) {
+				vt->state = VT_GROUND;
+				vt_csi(vt, c);
+			} else if (c == '\033') {
+				vt->count.unknown++;
+				vt->state = VT_ESC;
+			}
+			continue;
+		default:
+			break;
+		}
+
+		switch (c) {
+		case '\033':
+			vt->state = VT_ESC;
+			break;
+		case '\r':
+			vt->count.controls++;
+			vt->col = 0;
+			vt->wrap_pending = 0;
+			break;
+		case '\n': case '\v': case '\f':
+			vt->count.controls++;
+			vt_linefeed(vt);
+			break;
+		case '\b':
+			vt->count.controls++;
+			if (vt->col > 0) vt->col--;
+			vt->wrap_pending = 0;
+			break;
+		case '\t':
+			/* Tab stops every 8 columns; the cells passed over keep
+			 * whatever they had */
+			vt->count.controls++;
+			vt->col = (vt->col | 7) + 1;
+			if (vt->col >= vt->cols) vt->col = vt->cols - 1;
+			vt->wrap_pending = 0;
+			break;
+		case '\a': case '\0': case 0x7f:
+			break;
+		default:
+			if ((unsigned char)c < 0x20) vt->count.unknown++;
+			else vt_put(vt, c);
+			break;
+		}
+	}
+	return;
+}
+
+
+/* Copy a screen row (1-based) without its trailing blanks; returns
+ * the length, or -1 if there is no such row */
+int vt_row_text(const struct vt *vt, int row, char *buf, int size)
+{
+	const struct vt_cell *cell;
+	int i, len = 0;
+
+	if (row < 1 || row > vt->rows || size < 1) return -1;
+	cell = vt->cells + (row - 1) * vt->cols;
+	for (i = 0; i < vt->cols && i < size - 1; i++) {
+		buf[i] = cell[i].c;
+		if (cell[i].c != ' ') len = i + 1;
+	}
+	buf[len] = '\0';
+	return len;
+}
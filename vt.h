@@ -0,0 +1,64 @@
+/*
+ * Virtual VT100 screen model for vee-eye's test and benchmark drivers
+ *
+ * Terminal output is fed in as it arrives and applied to a grid of
+ * cells: text, CR/LF/BS/HT, cursor moves (CUP, CUU/CUD/CUF/CUB), erases
+ * (EL, ED), scrolling (IND, RI, NEL, DECSTBM), SGR attributes and the
+ * autowrap mode. Every operation is counted so that renderers can be
+ * scored by what they send as well as checked by what ends up on the
+ * screen.
+ */
+
+#ifndef VT_H
+#define VT_H
+
+#define VT_BOLD 0x01
+#define VT_UNDERLINE 0x02
+#define VT_REVERSE 0x04
+
+#define VT_MAX_PARAMS 16
+
+struct vt_cell {
+	char c;
+	unsigned char attr;
+};
+
+/* What the terminal was asked to do */
+struct vt_counts {
+	unsigned long bytes;
+	unsigned long text;		/* characters put on the screen */
+	unsigned long controls;		/* CR, LF, BS, HT */
+	unsigned long cup;		/* absolute cursor positioning */
+	unsigned long moves;		/* relative cursor moves */
+	unsigned long el;
+	unsigned long ed;
+	unsigned long scrolls;		/* IND, RI, NEL and LFs that scroll */
+	unsigned long stbm;
+	unsigned long sgr;
+	unsigned long modes;		/* SM/RM */
+	unsigned long unknown;		/* sequences the model ignores */
+};
+
+struct vt {
+	int rows, cols;
+	struct vt_cell *cells;		/* rows * cols, row-major */
+	int row, col;			/* cursor, 0-based */
+	int top, bottom;		/* scroll region, 0-based inclusive */
+	int saved_row, saved_col;
+	unsigned char attr;
+	char autowrap;
+	char wrap_pending;		/* the last column was just written */
+	/* Escape sequence parser */
+	char state;
+	char private;			/* '?' etc. before the parameters */
+	int params[VT_MAX_PARAMS];
+	int param_count;
+	struct vt_counts count;
+};
+
+extern int vt_init(struct vt *vt, int rows, int cols);
+extern void vt_free(struct vt *vt);
+extern void vt_feed(struct vt *vt, const char *data, long len);
+extern int vt_row_text(const struct vt *vt, int row, char *buf, int size);
+
+#endif	/* VT_H */